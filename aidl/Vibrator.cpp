@@ -37,14 +37,20 @@
 #include <cutils/properties.h>
 #include <dirent.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <linux/input.h>
 #include <log/log.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <bits/epoll_event.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <string>
 #include <thread>
 
 #include "include/Vibrator.h"
@@ -65,6 +71,8 @@ namespace vibrator {
 #define NAME_BUF_SIZE           32
 #define PRIMITIVE_ID_MASK       0x8000
 #define MAX_PATTERN_ID          32767
+#define MAX_EFFECT_SLOTS        64
+#define MAX_PLAY_EVENTS         3
 
 #define MSM_CPU_LAHAINA         415
 #define APQ_CPU_LAHAINA         439
@@ -82,116 +90,659 @@ namespace vibrator {
 
 static const char LED_DEVICE[] = "/sys/class/leds/vibrator";
 static const char HAPTICS_SYSFS[] = "/sys/class/qcom-haptics";
+static const char INPUT_SYSFS[] = "/sys/class/input";
+static const char HAPTICS_DEVICES_XML[] = "/vendor/etc/excluded-input-devices.xml";
 
 static constexpr int32_t ComposeDelayMaxMs = 1000;
 static constexpr int32_t ComposeSizeMax = 256;
+static constexpr size_t ComposePlanCacheSize = 16;
+#ifdef USE_EFFECT_STREAM
+static constexpr uint32_t ComposeStreamMaxSamples = 32768;
+static constexpr uint32_t ComposeStreamId = PRIMITIVE_ID_MASK | MAX_PATTERN_ID;
+#endif
 
-enum composeEvent {
-    STOP_COMPOSE = 0,
-};
+static int64_t getMonotonicNs() {
+    struct timespec ts;
 
-InputFFDevice::InputFFDevice()
-{
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t getMonotonicUs() {
+    return getMonotonicNs() / 1000;
+}
+
+/* Count the threads of the HAL process */
+static int countThreads() {
     DIR *dp;
-    FILE *fp = NULL;
     struct dirent *dir;
-    uint8_t ffBitmask[FF_CNT / 8];
+    int count = 0;
+
+    dp = opendir("/proc/self/task");
+    if (dp == NULL)
+        return INVALID_VALUE;
+
+    while ((dir = readdir(dp)) != NULL) {
+        if (dir->d_name[0] != '.')
+            count++;
+    }
+
+    closedir(dp);
+    return count;
+}
+
+/* Read a one line sysfs attribute without its newline */
+static int readSysfsLine(const char *path, char *buf, size_t len) {
+    int fd, ret;
+
+    fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+        return -errno;
+
+    ret = TEMP_FAILURE_RETRY(read(fd, buf, len - 1));
+    close(fd);
+    if (ret < 0)
+        return -errno;
+
+    buf[ret] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return ret;
+}
+
+/*
+ * Names of the supported haptics input devices, read once from the list of
+ * the input devices the framework excludes, which is shipped with the HAL.
+ * The built-in list is used if the file can't be read.
+ */
+static const std::vector<std::string>& hapticsDeviceNames() {
+    static std::vector<std::string> names;
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        char line[256];
+        const char *start, *end;
+        FILE *fp;
+
+        fp = fopen(HAPTICS_DEVICES_XML, "re");
+        if (fp != NULL) {
+            while (fgets(line, sizeof(line), fp) != NULL) {
+                start = strstr(line, "<device name=\"");
+                if (start == NULL)
+                    continue;
+
+                start += strlen("<device name=\"");
+                end = strchr(start, '"');
+                if (end != NULL && end != start)
+                    names.emplace_back(start, end - start);
+            }
+            fclose(fp);
+        } else {
+            ALOGE("open %s failed, errno = %d", HAPTICS_DEVICES_XML, errno);
+        }
+
+        if (names.empty())
+            names = {"qcom-hv-haptics", "qti-haptics", "aw8624_haptic", "aw8695_haptic",
+                     "aw8697_haptic", "awinic_haptic"};
+    });
+
+    return names;
+}
+
+int scanInputDevices(std::function<bool(const char *node, const char *name)> match) {
+    char path[PATH_MAX];
+    char name[256];
+    struct dirent *dir;
+    DIR *dp;
+
+    dp = opendir(INPUT_SYSFS);
+    if (!dp) {
+        ALOGE("open %s failed, errno = %d", INPUT_SYSFS, errno);
+        return -errno;
+    }
+
+    while ((dir = readdir(dp)) != NULL) {
+        if (strncmp(dir->d_name, "event", strlen("event")))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s/device/name", INPUT_SYSFS, dir->d_name);
+        if (readSysfsLine(path, name, sizeof(name)) < 0)
+            continue;
+
+        if (match(dir->d_name, name))
+            break;
+    }
+
+    closedir(dp);
+    return 0;
+}
+
+/** Find the event node of the haptics device
+ *
+ *  Only sysfs is read: the name of each input device and its ff capability
+ *  bitmap, which is "0" for the devices without force feedback. None of the
+ *  device nodes is opened, so the other input drivers are left alone.
+ */
+static int findHapticsDevice(char *devicename, size_t len, char *name, size_t nameLen) {
+    const std::vector<std::string>& names = hapticsDeviceNames();
+    int ret = -ENODEV;
+    int rc;
+
+    rc = scanInputDevices([&](const char *node, const char *devName) {
+        char path[PATH_MAX];
+        char ff[NAME_BUF_SIZE];
+
+        if (std::find(names.begin(), names.end(), devName) == names.end())
+            return false;
+
+        snprintf(path, sizeof(path), "%s/%s/device/capabilities/ff", INPUT_SYSFS, node);
+        if (readSysfsLine(path, ff, sizeof(ff)) < 0 || !strcmp(ff, "0")) {
+            ALOGD("%s has no force feedback\n", devName);
+            return false;
+        }
+
+        strlcpy(name, devName, nameLen);
+        snprintf(devicename, len, "/dev/input/%s", node);
+        ret = 0;
+        return true;
+    });
+
+    return rc < 0 ? rc : ret;
+}
+
+InputFFDevice::InputFFDevice()
+{
+    int64_t startUs = getMonotonicUs();
     char devicename[PATH_MAX];
-    const char *INPUT_DIR = "/dev/input/";
     char name[NAME_BUF_SIZE];
-    int fd, ret;
-    int soc = property_get_int32("ro.vendor.qti.soc_id", -1);
+    int fd;
 
     mVibraFd = INVALID_VALUE;
     mSupportGain = false;
     mSupportEffects = false;
     mSupportExternalControl = false;
+    mSupportStatus = false;
     mCurrAppId = INVALID_VALUE;
     mCurrMagnitude = 0x7fff;
+    mCurrGain = INVALID_VALUE;
+    mPendingGain = INVALID_VALUE;
+    mAmplitude = STRONG_MAGNITUDE;
+    mPlayWrites = 0;
+    mPlayEvents = 0;
     mInExternalControl = false;
+    mSlotTick = 0;
+    mCacheHits = 0;
+    mCacheMisses = 0;
+    mPinnedSlots = 0;
+    mWarmUpTimeUs = 0;
+    mProbeTimeUs = 0;
+    mRediscoveries = 0;
+    mGone = false;
+    mProbeFromCache = false;
+    mProbeSaved = false;
+    mMultiSlot = property_get_bool("ro.vendor.qti.vibrator.multi_slot", false);
+
+    /* Use the device probed on the previous boot if it's still the same */
+    if (ProbeCache::load(&mProbe) == 0) {
+        fd = TEMP_FAILURE_RETRY(open(mProbe.node.c_str(), O_RDWR | O_CLOEXEC));
+        if (fd >= 0 && probeDevice(fd, true) == 0) {
+            ALOGI("%s is detected at %s from probe cache\n", mProbe.name.c_str(),
+                  mProbe.node.c_str());
+            mDevicePath = mProbe.node;
+            mProbeFromCache = true;
+            mProbeSaved = true;
+            goto out;
+        }
 
-    dp = opendir(INPUT_DIR);
-    if (!dp) {
-        ALOGE("open %s failed, errno = %d", INPUT_DIR, errno);
-        return;
+        if (fd >= 0)
+            close(fd);
+        mVibraFd = INVALID_VALUE;
+        mSupportGain = false;
+        mSupportEffects = false;
+        mSupportStatus = false;
     }
 
-    memset(ffBitmask, 0, sizeof(ffBitmask));
-    while ((dir = readdir(dp)) != NULL){
-        if (dir->d_name[0] == '.' &&
-            (dir->d_name[1] == '\0' ||
-             (dir->d_name[1] == '.' && dir->d_name[2] == '\0')))
-            continue;
+    if (findHapticsDevice(devicename, sizeof(devicename), name, sizeof(name)) < 0) {
+        ALOGE("no supported haptics device is found");
+        goto out;
+    }
 
-        snprintf(devicename, PATH_MAX, "%s%s", INPUT_DIR, dir->d_name);
-        fd = TEMP_FAILURE_RETRY(open(devicename, O_RDWR));
-        if (fd < 0) {
-            ALOGE("open %s failed, errno = %d", devicename, errno);
-            continue;
-        }
+    ALOGI("%s is detected at %s\n", name, devicename);
+    fd = TEMP_FAILURE_RETRY(open(devicename, O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        ALOGE("open %s failed, errno = %d", devicename, errno);
+        goto out;
+    }
+
+    mProbe.node = devicename;
+    mProbe.name = name;
+    mProbe.hasDurations = false;
+    if (probeDevice(fd, false) < 0)
+        close(fd);
+    else
+        mDevicePath = devicename;
+
+out:
+    mProbeTimeUs = getMonotonicUs() - startUs;
+    ALOGI("haptics device probed in %ldus", mProbeTimeUs);
+}
+
+/* Check if the device in use is still there, its fd fails with ENODEV once it's gone */
+bool InputFFDevice::isPresent() {
+    std::lock_guard<std::mutex> lock(mLock);
+    int version;
+
+    if (mVibraFd == INVALID_VALUE || mGone)
+        return false;
+
+    return TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCGVERSION, &version)) != -1;
+}
+
+/* Note the device hung up, so the next input device added is looked at */
+void InputFFDevice::markGone() {
+    mGone = true;
+}
+
+/** Look for the haptics device again, after it was probed late or reloaded
+ *
+ *  The new device replaces the old one under the playback lock, so a playback
+ *  either goes to the old device or to the new one. The caller must stop
+ *  watching statusFd() before, the old fd is closed.
+ *
+ *  Return 1 if a new device is used, 0 if the device in use is still there,
+ *  or a negative value if no device is found.
+ */
+int InputFFDevice::rediscover() {
+    char devicename[PATH_MAX];
+    char name[NAME_BUF_SIZE];
+    int fd, version;
+
+    if (findHapticsDevice(devicename, sizeof(devicename), name, sizeof(name)) < 0)
+        return -ENODEV;
 
-        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCGNAME(sizeof(name)), name));
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mVibraFd != INVALID_VALUE && mDevicePath == devicename &&
+            TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCGVERSION, &version)) != -1) {
+        mGone = false;
+        return 0;
+    }
+
+    fd = TEMP_FAILURE_RETRY(open(devicename, O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        ALOGE("open %s failed, errno = %d", devicename, errno);
+        return -errno;
+    }
+
+    /* The slots and the state of the old device mean nothing to the new one */
+    if (mVibraFd != INVALID_VALUE)
+        close(mVibraFd);
+    mVibraFd = INVALID_VALUE;
+    mSupportGain = false;
+    mSupportEffects = false;
+    mSupportExternalControl = false;
+    mSupportStatus = false;
+    mCurrAppId = INVALID_VALUE;
+    mCurrGain = INVALID_VALUE;
+    mSlots.clear();
+    mPinnedSlots = 0;
+    mDevicePath.clear();
+    mProbeFromCache = false;
+    mProbeSaved = false;
+    mProbe.node = devicename;
+    mProbe.name = name;
+    mProbe.hasDurations = false;
+
+    if (probeDevice(fd, false) < 0) {
+        close(fd);
+        return -ENODEV;
+    }
+
+    mDevicePath = devicename;
+    mGone = false;
+    mRediscoveries++;
+    ALOGI("%s is detected again at %s\n", name, devicename);
+    return 1;
+}
+
+/** Check the ff capabilities of the haptics device and use it if it can vibrate
+ *
+ *  The capabilities are read from the device into mProbe, or taken from mProbe
+ *  if it was loaded from the probe cache.
+ */
+int InputFFDevice::probeDevice(int fd, bool cached) {
+    uint8_t evBitmask[EV_CNT / 8];
+    int clockId = CLOCK_MONOTONIC;
+    int soc, ret, slots;
+    FILE *fp = NULL;
+
+    if (!cached) {
+        memset(mProbe.ffBitmask, 0, sizeof(mProbe.ffBitmask));
+        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCGBIT(EV_FF, sizeof(mProbe.ffBitmask)),
+                    mProbe.ffBitmask));
         if (ret == -1) {
-            ALOGE("get input device name %s failed, errno = %d\n", devicename, errno);
-            close(fd);
-            continue;
+            ALOGE("ioctl failed, errno = %d", errno);
+            return -1;
         }
+    }
 
-        if (strcmp(name, "qcom-hv-haptics") && strcmp(name, "qti-haptics")
-                && strcmp(name, "aw8624_haptic")
-                && strcmp(name, "aw8695_haptic")
-                && strcmp(name, "aw8697_haptic")
-                && strcmp(name, "awinic_haptic")) {
-            ALOGD("not a supported haptics device\n");
-            close(fd);
-            continue;
+    if (!test_bit(FF_CONSTANT, mProbe.ffBitmask) && !test_bit(FF_PERIODIC, mProbe.ffBitmask)) {
+        ALOGE("haptics device supports neither FF_CONSTANT nor FF_PERIODIC");
+        return -1;
+    }
+
+    mVibraFd = fd;
+    if (test_bit(FF_CUSTOM, mProbe.ffBitmask))
+        mSupportEffects = true;
+    if (test_bit(FF_GAIN, mProbe.ffBitmask))
+        mSupportGain = true;
+
+    /* The driver reports when the effects stop if it supports EV_FF_STATUS */
+    if (!cached) {
+        memset(evBitmask, 0, sizeof(evBitmask));
+        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCGBIT(0, sizeof(evBitmask)), evBitmask));
+        mProbe.supportStatus = ret != -1 && test_bit(EV_FF_STATUS, evBitmask);
+    }
+    if (mProbe.supportStatus) {
+        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCSCLOCKID, &clockId));
+        if (ret != -1)
+            mSupportStatus = true;
+    }
+
+    /* Size the uploaded effect cache from the number of kernel ff slots */
+    if (!cached) {
+        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCGEFFECTS, &slots));
+        if (ret == -1 || slots <= 0) {
+            ALOGE("get ff effects count failed, errno = %d", errno);
+            slots = 1;
+        }
+        if (slots > MAX_EFFECT_SLOTS)
+            slots = MAX_EFFECT_SLOTS;
+        mProbe.slots = slots;
+    }
+    /*
+     * Some drivers, e.g. qcom-hv-haptics, load the waveform into the hardware
+     * when the effect is uploaded and play it whatever the id written is. The
+     * effects can only be kept in several slots with a driver playing the
+     * effect of the id, otherwise a single slot is used so that a hit is
+     * always on the effect which was uploaded last.
+     */
+    slots = mMultiSlot ? std::min(mProbe.slots, MAX_EFFECT_SLOTS) : 1;
+    mSlots.assign(slots, {INVALID_VALUE, 0, INVALID_VALUE, 0, NULL, 0, 0, false, {}, false});
+    ALOGI("%zu ff effect slots are used out of %d", mSlots.size(), mProbe.slots);
+
+    if (!cached) {
+        soc = property_get_int32("ro.vendor.qti.soc_id", -1);
+        if (soc <= 0 && (fp = fopen("/sys/devices/soc0/soc_id", "r")) != NULL) {
+            fscanf(fp, "%u", &soc);
+            fclose(fp);
+        }
+        switch (soc) {
+        case MSM_CPU_LAHAINA:
+        case APQ_CPU_LAHAINA:
+        case MSM_CPU_SHIMA:
+        case MSM_CPU_SM8325:
+        case APQ_CPU_SM8325P:
+        case MSM_CPU_TARO:
+        case MSM_CPU_TARO_LTE:
+        case MSM_CPU_YUPIK:
+        case MSM_CPU_CAPE:
+        case APQ_CPU_CAPE:
+        case MSM_CPU_KALAMA:
+            mProbe.supportExternalControl = true;
+            break;
+        default:
+            mProbe.supportExternalControl = false;
+            break;
         }
+    }
+    mSupportExternalControl = mProbe.supportExternalControl;
 
-        ALOGI("%s is detected at %s\n", name, devicename);
-        ret = TEMP_FAILURE_RETRY(ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ffBitmask)), ffBitmask));
-        if (ret == -1) {
-            ALOGE("ioctl failed, errno = %d", errno);
-            close(fd);
+    return 0;
+}
+
+/* Take the primitive durations of the probe cache, only once as they may be stale afterwards */
+bool InputFFDevice::cachedDurations(std::array<int32_t, 64> *durations) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (!mProbeFromCache || !mProbe.hasDurations)
+        return false;
+
+    *durations = mProbe.primitiveDurationMs;
+    mProbeFromCache = false;
+    return true;
+}
+
+/* Save the probe result with the primitive durations, unless the cache already has them */
+void InputFFDevice::saveProbe(const std::array<int32_t, 64>& durations) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mVibraFd == INVALID_VALUE)
+        return;
+    if (mProbeSaved && mProbe.hasDurations && mProbe.primitiveDurationMs == durations)
+        return;
+
+    mProbe.primitiveDurationMs = durations;
+    mProbe.hasDurations = true;
+    mProbeSaved = ProbeCache::save(mProbe) == 0;
+}
+
+/** Look up an uploaded effect
+ *
+ *  Return the slot holding the effect which matches all of the parameters, or
+ *  NULL if the effect has not been uploaded yet or its slot was evicted.
+ */
+InputFFDevice::EffectSlot *InputFFDevice::findSlot(int effectId, int16_t magnitude,
+        uint32_t length, const void *stream) {
+    for (auto& slot : mSlots) {
+        if (slot.id != INVALID_VALUE && !slot.uncached && slot.effectId == effectId &&
+                slot.magnitude == magnitude && slot.length == length &&
+                slot.stream == stream)
+            return &slot;
+    }
+
+    return NULL;
+}
+
+/** Upload an effect into a kernel ff slot
+ *
+ *  A free slot is used if there is one, otherwise the least recently used slot
+ *  which isn't pinned or reserved by a prepared effect is evicted, or the least recently used unpinned
+ *  slot if all of them are reserved. The slot of the effect being played is only evicted when there
+ *  is no other choice, and never if @evictPlaying is false. The slot is reused in place by the
+ *  kernel if the evicted effect is of the same type, otherwise it's erased before the new effect
+ *  is uploaded.
+ *
+ *  The custom_data in periodic is reused for returning the playLengthMs from
+ *  kernel space to userspace if the pattern is defined in kernel driver. It's
+ *  been defined with following format:
+ *       <effect-ID, play-time-in-seconds, play-time-in-milliseconds>.
+ *  The effect-ID is used for passing down the predefined effect to kernel
+ *  driver, and the rest two parameters are used for returning back the real
+ *  playing length from kernel driver.
+ */
+InputFFDevice::EffectSlot *InputFFDevice::uploadEffect(int effectId, int16_t magnitude,
+        uint32_t length, const void *stream, bool evictPlaying) {
+    struct ff_effect effect;
+    int16_t data[CUSTOM_DATA_LEN] = {0, 0, 0};
+    EffectSlot *victim = NULL, *fallback = NULL;
+    int64_t now = getMonotonicNs();
+    int ret;
+
+    for (auto& slot : mSlots) {
+        if (slot.id == INVALID_VALUE) {
+            victim = &slot;
+            fallback = NULL;
+            break;
+        }
+        if (slot.pinned || (slot.id == mCurrAppId && !evictPlaying))
+            continue;
+        if (fallback == NULL || slot.lastUsed < fallback->lastUsed)
+            fallback = &slot;
+        if (isReserved(slot, now) || (slot.id == mCurrAppId && mSlots.size() > 1))
             continue;
+        if (victim == NULL || slot.lastUsed < victim->lastUsed)
+            victim = &slot;
+    }
+
+    /* A reservation only delays the eviction, it never makes a play fail */
+    if (victim == NULL)
+        victim = fallback;
+    if (victim == NULL)
+        return NULL;
+
+    if (victim->id != INVALID_VALUE &&
+            (victim->id == mCurrAppId ||
+             (victim->effectId == INVALID_VALUE) != (effectId == INVALID_VALUE)))
+        releaseSlot(victim);
+
+    memset(&effect, 0, sizeof(effect));
+    if (effectId != INVALID_VALUE) {
+        data[0] = effectId;
+        effect.type = FF_PERIODIC;
+        effect.u.periodic.waveform = FF_CUSTOM;
+        effect.u.periodic.magnitude = magnitude;
+        effect.u.periodic.custom_data = data;
+        effect.u.periodic.custom_len = sizeof(int16_t) * CUSTOM_DATA_LEN;
+#ifdef USE_EFFECT_STREAM
+        if (stream != NULL) {
+            effect.u.periodic.custom_data = (int16_t *)stream;
+            effect.u.periodic.custom_len = sizeof(struct effect_stream);
         }
+#endif
+    } else {
+        effect.type = FF_CONSTANT;
+        effect.u.constant.level = magnitude;
+        effect.replay.length = length;
+    }
+
+    effect.id = victim->id;
+    effect.replay.delay = 0;
+
+    ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCSFF, &effect));
+    if (ret == -1) {
+        ALOGE("ioctl EVIOCSFF failed, errno = %d", -errno);
+        releaseSlot(victim);
+        return NULL;
+    }
+
+    victim->id = effect.id;
+    victim->effectId = effectId;
+    victim->magnitude = magnitude;
+    victim->length = length;
+    victim->stream = stream;
+    victim->uncached = false;
+    victim->playLengthMs = data[1] * 1000 + data[2];
+#ifdef USE_EFFECT_STREAM
+    if (stream != NULL) {
+        const struct effect_stream *es = (const struct effect_stream *)stream;
 
-        if (test_bit(FF_CONSTANT, ffBitmask) ||
-                test_bit(FF_PERIODIC, ffBitmask)) {
-            mVibraFd = fd;
-            if (test_bit(FF_CUSTOM, ffBitmask))
-                mSupportEffects = true;
-            if (test_bit(FF_GAIN, ffBitmask))
-                mSupportGain = true;
-
-            if (soc <= 0 && (fp = fopen("/sys/devices/soc0/soc_id", "r")) != NULL) {
-                fscanf(fp, "%u", &soc);
-                fclose(fp);
+        if (es->play_rate_hz != 0)
+            victim->playLengthMs = ((es->length * 1000) / es->play_rate_hz) + 1;
+    }
+#endif
+
+    return victim;
+}
+
+/** Erase the effect in a kernel ff slot and mark the slot as free */
+void InputFFDevice::releaseSlot(EffectSlot *slot) {
+    int ret;
+
+    if (slot->id == INVALID_VALUE)
+        return;
+
+    ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCRMFF, slot->id));
+    if (ret == -1)
+        ALOGE("ioctl EVIOCRMFF failed, errno = %d", -errno);
+
+    if (slot->id == mCurrAppId)
+        mCurrAppId = INVALID_VALUE;
+    slot->id = INVALID_VALUE;
+    slot->effectId = INVALID_VALUE;
+    for (auto& until : slot->reservedUntilNs)
+        until = 0;
+    if (slot->pinned) {
+        slot->pinned = false;
+        mPinnedSlots--;
+    }
+}
+
+static const void *getStream(int effectId __unused) {
+#ifdef USE_EFFECT_STREAM
+    return get_effect_stream(effectId);
+#else
+    return NULL;
+#endif
+}
+
+/** Pre-upload effects into pinned slots
+ *
+ *  Upload every effect in @effectIds at the LIGHT, MEDIUM and STRONG magnitudes,
+ *  or only at the neutral magnitude if the strength is applied by FF_GAIN, so
+ *  playing them never has to upload on the hot path. The pinned slots are
+ *  never evicted, one slot is always left unpinned for constant effects and
+ *  the effects which don't fit.
+ *
+ *  So ro.vendor.qti.vibrator.warmup requires ro.vendor.qti.vibrator.multi_slot,
+ *  with the single slot used otherwise nothing can be pinned.
+ */
+void InputFFDevice::warmUp(const std::vector<int>& effectIds) {
+    const int16_t magnitudes[] = {STRONG_MAGNITUDE, MEDIUM_MAGNITUDE, LIGHT_MAGNITUDE};
+    int magnitudeCount = mSupportGain ? 1 : sizeof(magnitudes) / sizeof(magnitudes[0]);
+    struct timespec start, end;
+    EffectSlot *slot;
+    int skipped = 0;
+    int16_t magnitude;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mVibraFd == INVALID_VALUE)
+        return;
+
+    if (mSlots.size() < 2) {
+        ALOGW("warm up needs ro.vendor.qti.vibrator.multi_slot, %zu ff slot is used",
+              mSlots.size());
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (auto id : effectIds) {
+        for (int i = 0; i < magnitudeCount; i++) {
+            magnitude = magnitudes[i];
+            if (findSlot(id, magnitude, 0, getStream(id)) != NULL)
+                continue;
+
+            if (mPinnedSlots + 1 >= (int)mSlots.size()) {
+                skipped++;
+                continue;
             }
-            switch (soc) {
-            case MSM_CPU_LAHAINA:
-            case APQ_CPU_LAHAINA:
-            case MSM_CPU_SHIMA:
-            case MSM_CPU_SM8325:
-            case APQ_CPU_SM8325P:
-            case MSM_CPU_TARO:
-            case MSM_CPU_TARO_LTE:
-            case MSM_CPU_YUPIK:
-            case MSM_CPU_CAPE:
-            case APQ_CPU_CAPE:
-            case MSM_CPU_KALAMA:
-                mSupportExternalControl = true;
-                break;
-            default:
-                mSupportExternalControl = false;
-                break;
+
+            slot = uploadEffect(id, magnitude, 0, getStream(id));
+            if (slot == NULL) {
+                skipped++;
+                continue;
             }
-            break;
-        }
 
-        close(fd);
+            slot->lastUsed = ++mSlotTick;
+            slot->pinned = true;
+            mPinnedSlots++;
+            ALOGD("effect 0x%x magnitude 0x%x pinned in slot %d, play length %ldms",
+                    id, magnitude, slot->id, slot->playLengthMs);
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    closedir(dp);
+    mWarmUpTimeUs = (end.tv_sec - start.tv_sec) * 1000000L +
+            (end.tv_nsec - start.tv_nsec) / 1000;
+    ALOGI("warm up done in %ldus, %d/%zu slots pinned, %d effects not uploaded",
+            mWarmUpTimeUs, mPinnedSlots, mSlots.size(), skipped);
+}
+
+static void fillEvent(struct input_event *ie, uint16_t code, int32_t value) {
+    ie->time.tv_sec = 0;
+    ie->time.tv_usec = 0;
+    ie->type = EV_FF;
+    ie->code = code;
+    ie->value = value;
 }
 
 /** Play vibration
@@ -204,22 +755,22 @@ InputFFDevice::InputFFDevice()
  *  @param timeoutMs: playing length, non-zero means playing, zero means stop playing.
  *  @param playLengthMs: the playing length in ms unit which will be returned to
  *                    VibratorService if the request is playing a predefined effect.
- *                    The custom_data in periodic is reused for returning the playLengthMs
- *                    from kernel space to userspace if the pattern is defined in kernel
- *                    driver. It's been defined with following format:
- *                       <effect-ID, play-time-in-seconds, play-time-in-milliseconds>.
- *                    The effect-ID is used for passing down the predefined effect to
- *                    kernel driver, and the rest two parameters are used for returning
- *                    back the real playing length from kernel driver.
+ *  @param stream:    effect stream to be uploaded for the effect instead of the one
+ *                    defined for effectId. Such a stream is never looked up in the
+ *                    cache, as its content is only valid for this play.
+ *
+ *  The effect is uploaded only if it isn't cached in one of the kernel ff slots,
+ *  so playing a recently played effect again costs a single write() of the pending
+ *  gain, the stop of the previous effect and the play of the new effect.
  */
-int InputFFDevice::play(int effectId, uint32_t timeoutMs, long *playLengthMs) {
-    struct ff_effect effect;
-    struct input_event play;
-    int16_t data[CUSTOM_DATA_LEN] = {0, 0, 0};
+int InputFFDevice::play(int effectId, uint32_t timeoutMs, long *playLengthMs,
+        const void *stream) {
+    struct input_event events[MAX_PLAY_EVENTS];
+    EffectSlot *slot = NULL;
+    bool cached = (stream == NULL);
+    int count;
+    uint32_t length = 0;
     int ret;
-#ifdef USE_EFFECT_STREAM
-    const struct effect_stream *stream;
-#endif
 
     /* For QMAA compliance, return OK even if vibrator device doesn't exist */
     if (mVibraFd == INVALID_VALUE) {
@@ -229,71 +780,68 @@ int InputFFDevice::play(int effectId, uint32_t timeoutMs, long *playLengthMs) {
     }
 
     if (timeoutMs != 0) {
-        if (mCurrAppId != INVALID_VALUE) {
-            ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCRMFF, mCurrAppId));
-            if (ret == -1) {
-                ALOGE("ioctl EVIOCRMFF failed, errno = %d", -errno);
+        if (effectId == INVALID_VALUE)
+            length = timeoutMs;
+        else if (cached)
+            stream = getStream(effectId);
+
+        if (cached)
+            slot = findSlot(effectId, mCurrMagnitude, length, stream);
+        if (slot != NULL) {
+            mCacheHits++;
+        } else {
+            if (cached)
+                mCacheMisses++;
+            slot = uploadEffect(effectId, mCurrMagnitude, length, stream);
+            if (slot == NULL) {
+                ret = -1;
                 goto errout;
             }
-            mCurrAppId = INVALID_VALUE;
-        }
-
-        memset(&effect, 0, sizeof(effect));
-        if (effectId != INVALID_VALUE) {
-            data[0] = effectId;
-            effect.type = FF_PERIODIC;
-            effect.u.periodic.waveform = FF_CUSTOM;
-            effect.u.periodic.magnitude = mCurrMagnitude;
-            effect.u.periodic.custom_data = data;
-            effect.u.periodic.custom_len = sizeof(int16_t) * CUSTOM_DATA_LEN;
-#ifdef USE_EFFECT_STREAM
-            stream = get_effect_stream(effectId);
-            if (stream != NULL) {
-                effect.u.periodic.custom_data = (int16_t *)stream;
-                effect.u.periodic.custom_len = sizeof(*stream);
-            }
-#endif
-        } else {
-            effect.type = FF_CONSTANT;
-            effect.u.constant.level = mCurrMagnitude;
-            effect.replay.length = timeoutMs;
         }
-
-        effect.id = mCurrAppId;
-        effect.replay.delay = 0;
-
-        ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCSFF, &effect));
-        if (ret == -1) {
-            ALOGE("ioctl EVIOCSFF failed, errno = %d", -errno);
+        /*
+         * An uncached stream is the first to be evicted, and its stream pointer
+         * is dropped as it's only valid during this call.
+         */
+        slot->lastUsed = cached ? ++mSlotTick : 0;
+        slot->uncached = !cached;
+        if (!cached)
+            slot->stream = NULL;
+
+        /*
+         * Submit the pending gain, the stop of the previous effect and the play
+         * of the new effect in a single write.
+         */
+        count = 0;
+        if (mPendingGain != INVALID_VALUE && mPendingGain != mCurrGain)
+            fillEvent(&events[count++], FF_GAIN, mPendingGain);
+        if (mCurrAppId != INVALID_VALUE && mCurrAppId != slot->id)
+            fillEvent(&events[count++], mCurrAppId, 0);
+        fillEvent(&events[count++], slot->id, 1);
+
+        mCurrAppId = slot->id;
+        if (effectId != INVALID_VALUE && playLengthMs != NULL)
+            *playLengthMs = slot->playLengthMs;
+
+        ret = TEMP_FAILURE_RETRY(write(mVibraFd, (const void*)events, count * sizeof(events[0])));
+        mPlayWrites++;
+        mPlayEvents += count;
+        /* The uploaded effect is still valid, only the playback state is unknown */
+        if (ret != (int)(count * sizeof(events[0]))) {
+            ALOGE("write failed, ret = %d, errno = %d\n", ret, -errno);
+            mCurrGain = INVALID_VALUE;
+            ret = -1;
             goto errout;
         }
 
-        mCurrAppId = effect.id;
-        if (effectId != INVALID_VALUE && playLengthMs != NULL) {
-            *playLengthMs = data[1] * 1000 + data[2];
-#ifdef USE_EFFECT_STREAM
-            if (stream != NULL && stream->play_rate_hz != 0)
-                *playLengthMs = ((stream->length * 1000) / stream->play_rate_hz) + 1;
-#endif
-        }
-
-        play.value = 1;
-        play.type = EV_FF;
-        play.code = mCurrAppId;
-        play.time.tv_sec = 0;
-        play.time.tv_usec = 0;
-        ret = TEMP_FAILURE_RETRY(write(mVibraFd, (const void*)&play, sizeof(play)));
-        if (ret == -1) {
-            ALOGE("write failed, errno = %d\n", -errno);
-            ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCRMFF, mCurrAppId));
-            if (ret == -1)
-                ALOGE("ioctl EVIOCRMFF failed, errno = %d", -errno);
-            goto errout;
+        if (mPendingGain != INVALID_VALUE) {
+            mCurrGain = mPendingGain;
+            mPendingGain = INVALID_VALUE;
         }
     } else if (mCurrAppId != INVALID_VALUE) {
-        ret = TEMP_FAILURE_RETRY(ioctl(mVibraFd, EVIOCRMFF, mCurrAppId));
+        fillEvent(&events[0], mCurrAppId, 0);
+        ret = TEMP_FAILURE_RETRY(write(mVibraFd, (const void*)events, sizeof(events[0])));
         if (ret == -1) {
-            ALOGE("ioctl EVIOCRMFF failed, errno = %d", -errno);
+            ALOGE("write failed, errno = %d\n", -errno);
             goto errout;
         }
         mCurrAppId = INVALID_VALUE;
@@ -306,16 +854,26 @@ errout:
 }
 
 int InputFFDevice::on(int32_t timeoutMs) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    /* Restore the amplitude gain which may have been changed by an effect */
+    if (mSupportGain) {
+        mCurrMagnitude = mAmplitude;
+        mPendingGain = mAmplitude;
+    }
+
     return play(INVALID_VALUE, timeoutMs, NULL);
 }
 
 int InputFFDevice::off() {
+    std::lock_guard<std::mutex> lock(mLock);
+
     return play(INVALID_VALUE, 0, NULL);
 }
 
 int InputFFDevice::setAmplitude(uint8_t amplitude) {
+    std::lock_guard<std::mutex> lock(mLock);
     int tmp, ret;
-    struct input_event ie;
 
     /* For QMAA compliance, return OK even if vibrator device doesn't exist */
     if (mVibraFd == INVALID_VALUE)
@@ -323,45 +881,195 @@ int InputFFDevice::setAmplitude(uint8_t amplitude) {
 
     tmp = amplitude * (STRONG_MAGNITUDE - LIGHT_MAGNITUDE) / 255;
     tmp += LIGHT_MAGNITUDE;
+    ret = setGain(tmp);
+    if (ret != 0)
+        return ret;
+
+    mAmplitude = tmp;
+    mCurrMagnitude = tmp;
+    return 0;
+}
+
+/* Write FF_GAIN, skipped if the gain is already applied */
+int InputFFDevice::setGain(int16_t gain) {
+    struct input_event ie;
+    int ret;
+
+    if (mVibraFd == INVALID_VALUE || gain == mCurrGain)
+        return 0;
+
     ie.type = EV_FF;
     ie.code = FF_GAIN;
-    ie.value = tmp;
+    ie.value = gain;
 
     ret = TEMP_FAILURE_RETRY(write(mVibraFd, &ie, sizeof(ie)));
     if (ret == -1) {
         ALOGE("write FF_GAIN failed, errno = %d", -errno);
+        mCurrGain = INVALID_VALUE;
         return ret;
     }
 
-    mCurrMagnitude = tmp;
+    mCurrGain = gain;
+    mPendingGain = INVALID_VALUE;
     return 0;
 }
 
-int InputFFDevice::playEffect(int effectId, EffectStrength es, long *playLengthMs) {
-    if (effectId > MAX_PATTERN_ID) {
-        ALOGE("effect id %d exceeds %d", effectId, MAX_PATTERN_ID);
-        return -1;
+/** Apply the strength of an effect or primitive
+ *
+ *  If FF_GAIN is supported, the effect is uploaded with the neutral magnitude and
+ *  the strength is applied with FF_GAIN, so a single uploaded effect serves all
+ *  of the strengths. The gain is written by play() together with the play event.
+ *  Otherwise the strength is baked into the uploaded effect.
+ */
+void InputFFDevice::applyMagnitude(int16_t magnitude) {
+    if (!mSupportGain) {
+        mCurrMagnitude = magnitude;
+        return;
     }
 
+    mCurrMagnitude = STRONG_MAGNITUDE;
+    mPendingGain = magnitude;
+}
+
+static int effectMagnitude(EffectStrength es, int16_t *magnitude) {
     switch (es) {
     case EffectStrength::LIGHT:
-        mCurrMagnitude = LIGHT_MAGNITUDE;
+        *magnitude = LIGHT_MAGNITUDE;
         break;
     case EffectStrength::MEDIUM:
-        mCurrMagnitude = MEDIUM_MAGNITUDE;
+        *magnitude = MEDIUM_MAGNITUDE;
         break;
     case EffectStrength::STRONG:
-        mCurrMagnitude = STRONG_MAGNITUDE;
+        *magnitude = STRONG_MAGNITUDE;
         break;
     default:
         return -1;
     }
 
+    return 0;
+}
+
+int InputFFDevice::playEffect(int effectId, EffectStrength es, long *playLengthMs) {
+    std::lock_guard<std::mutex> lock(mLock);
+    int16_t magnitude;
+
+    if (effectId > MAX_PATTERN_ID) {
+        ALOGE("effect id %d exceeds %d", effectId, MAX_PATTERN_ID);
+        return -1;
+    }
+
+    if (effectMagnitude(es, &magnitude) != 0)
+        return -1;
+
+    applyMagnitude(magnitude);
     return play(effectId, INVALID_VALUE, playLengthMs);
 }
 
+/** Upload an effect and reserve its slot until expireNs
+ *
+ *  The reserved slot is not evicted before it expires, so a playEffect() of the
+ *  same effect and strength in the meantime only needs the play write. Each
+ *  owner holds one reservation at a time, reserving again only replaces the
+ *  previous reservation of the same owner.
+ *
+ *  Uploading never evicts the effect being played, as that would stop it. So
+ *  with a single slot, the default unless ro.vendor.qti.vibrator.multi_slot is
+ *  set, nothing is reserved unless the effect is already in the slot. This is
+ *  not an error, playEffect() then uploads the effect, and *playLengthMs is 0
+ *  as the play length is only known from the upload.
+ */
+int InputFFDevice::prepareEffect(int effectId, EffectStrength es, ReserveOwner owner,
+        int64_t expireNs, long *playLengthMs) {
+    int16_t magnitude;
+    const void *stream;
+    EffectSlot *slot;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mVibraFd == INVALID_VALUE) {
+        if (playLengthMs != NULL)
+            *playLengthMs = 0;
+        return 0;
+    }
+
+    if (effectId > MAX_PATTERN_ID || effectMagnitude(es, &magnitude) != 0)
+        return -1;
+
+    resetReservation(owner);
+    if (mSupportGain)
+        magnitude = STRONG_MAGNITUDE;
+    stream = getStream(effectId);
+
+    slot = findSlot(effectId, magnitude, 0, stream);
+    if (slot == NULL && mSlots.size() < 2) {
+        ALOGD("effect %d isn't reserved with a single ff slot", effectId);
+        if (playLengthMs != NULL)
+            *playLengthMs = 0;
+        return 0;
+    }
+    if (slot == NULL) {
+        slot = uploadEffect(effectId, magnitude, 0, stream, false);
+        if (slot == NULL) {
+            ALOGE("Failed to prepare effect %d", effectId);
+            return -1;
+        }
+    }
+    slot->lastUsed = ++mSlotTick;
+    slot->reservedUntilNs[owner] = expireNs;
+    if (playLengthMs != NULL)
+        *playLengthMs = slot->playLengthMs;
+
+    return 0;
+}
+
+/* Return the fd to read EV_FF_STATUS events from, or INVALID_VALUE if unsupported */
+int InputFFDevice::statusFd() {
+    return mSupportStatus ? mVibraFd.load() : INVALID_VALUE;
+}
+
+/* Return the kernel id of the effect which is played last */
+int16_t InputFFDevice::playingId() {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mCurrAppId;
+}
+
+void InputFFDevice::clearReservation(ReserveOwner owner) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    resetReservation(owner);
+}
+
+/* Called with mLock held */
+void InputFFDevice::resetReservation(ReserveOwner owner) {
+    for (auto& slot : mSlots)
+        slot.reservedUntilNs[owner] = 0;
+}
+
+/* Called with mLock held */
+bool InputFFDevice::isReserved(const EffectSlot& slot, int64_t now) {
+    for (auto until : slot.reservedUntilNs) {
+        if (until > now)
+            return true;
+    }
+
+    return false;
+}
+
+/* Map a primitive scale in [0, 1] to a magnitude in [LIGHT_MAGNITUDE, STRONG_MAGNITUDE] */
+static int16_t primitiveMagnitude(float amplitude) {
+    int tmp;
+
+    if (amplitude < 0.0f)
+        amplitude = 0.0f;
+    else if (amplitude > 1.0f)
+        amplitude = 1.0f;
+
+    tmp = (int)(amplitude * 0xff);
+    return LIGHT_MAGNITUDE + tmp * (STRONG_MAGNITUDE - LIGHT_MAGNITUDE) / 255;
+}
+
 int InputFFDevice::playPrimitive(int primitiveId, float amplitude, long *playLengthMs) {
-    int8_t tmp;
+    std::lock_guard<std::mutex> lock(mLock);
     int ret = 0;
 
     if (primitiveId > MAX_PATTERN_ID) {
@@ -370,10 +1078,7 @@ int InputFFDevice::playPrimitive(int primitiveId, float amplitude, long *playLen
     }
 
     primitiveId |= PRIMITIVE_ID_MASK;
-    tmp = (uint8_t)(amplitude * 0xff);
-    mCurrMagnitude = tmp * (STRONG_MAGNITUDE - LIGHT_MAGNITUDE) / 255;
-    mCurrMagnitude += LIGHT_MAGNITUDE;
-
+    applyMagnitude(primitiveMagnitude(amplitude));
     ret = play(primitiveId, INVALID_VALUE, playLengthMs);
     if (ret != 0)
         ALOGE("Failed to play primitive %d", primitiveId);
@@ -381,36 +1086,135 @@ int InputFFDevice::playPrimitive(int primitiveId, float amplitude, long *playLen
     return ret;
 }
 
-LedVibratorDevice::LedVibratorDevice() {
-    char devicename[PATH_MAX];
+#ifdef USE_EFFECT_STREAM
+/** Play a rendered effect stream
+ *
+ *  The samples already carry the scale of the effect, so the stream is played
+ *  at the neutral magnitude.
+ */
+int InputFFDevice::playStream(const struct effect_stream *stream, long *playLengthMs) {
+    std::lock_guard<std::mutex> lock(mLock);
+    int ret;
+
+    applyMagnitude(STRONG_MAGNITUDE);
+    ret = play(stream->effect_id, INVALID_VALUE, playLengthMs, stream);
+    if (ret != 0)
+        ALOGE("Failed to play stream of %u samples", stream->length);
+
+    return ret;
+}
+#endif
+
+/** Upload a primitive ahead of playing it
+ *
+ *  Make sure the primitive is in one of the kernel ff slots so the following
+ *  playPrimitive() only needs the play write. This is skipped if there is only
+ *  one slot, as uploading would evict the effect which is being played.
+ */
+int InputFFDevice::preparePrimitive(int primitiveId, float amplitude) {
+    int16_t magnitude;
+    const void *stream;
+    EffectSlot *slot;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mVibraFd == INVALID_VALUE || mSlots.size() < 2)
+        return 0;
+
+    if (primitiveId > MAX_PATTERN_ID)
+        return -1;
+
+    primitiveId |= PRIMITIVE_ID_MASK;
+    magnitude = mSupportGain ? STRONG_MAGNITUDE : primitiveMagnitude(amplitude);
+    stream = getStream(primitiveId);
+
+    slot = findSlot(primitiveId, magnitude, 0, stream);
+    if (slot == NULL) {
+        slot = uploadEffect(primitiveId, magnitude, 0, stream);
+        if (slot == NULL) {
+            ALOGE("Failed to prepare primitive %d", primitiveId);
+            return -1;
+        }
+    }
+    slot->lastUsed = ++mSlotTick;
+
+    return 0;
+}
+
+void InputFFDevice::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    int used = 0;
+
+    for (auto& slot : mSlots) {
+        if (slot.id != INVALID_VALUE)
+            used++;
+    }
+
+    dprintf(fd, "InputFFDevice:\n");
+    dprintf(fd, "  effect slots: %d/%zu used, %d pinned, multi-slot %s\n", used, mSlots.size(),
+            mPinnedSlots, mMultiSlot ? "enabled" : "disabled");
+    dprintf(fd, "  device: %s, rediscovered %d times\n",
+            mDevicePath.empty() ? "none" : mDevicePath.c_str(), mRediscoveries);
+    dprintf(fd, "  probe time: %ldus, warm up time: %ldus\n", mProbeTimeUs, mWarmUpTimeUs);
+    dprintf(fd, "  strength applied by: %s\n", mSupportGain ? "FF_GAIN" : "effect magnitude");
+    dprintf(fd, "  play writes: %" PRIu64 ", events: %" PRIu64 "\n", mPlayWrites, mPlayEvents);
+    dprintf(fd, "  effect cache hits: %" PRIu64 ", misses: %" PRIu64 "\n",
+            mCacheHits, mCacheMisses);
+}
+
+/* Open a LED attribute once, it's kept open and written at offset 0 */
+static int openLedAttribute(const char *name, int flags) {
+    char file[PATH_MAX];
     int fd;
 
+    snprintf(file, sizeof(file), "%s/%s", LED_DEVICE, name);
+    fd = TEMP_FAILURE_RETRY(open(file, flags | O_CLOEXEC));
+    if (fd < 0)
+        ALOGE("open %s failed, errno = %d", file, errno);
+
+    return fd;
+}
+
+LedVibratorDevice::LedVibratorDevice() {
     mDetected = false;
+    mWrites = 0;
+    mOnCount = 0;
+    mOnTotalUs = 0;
+    mOnMaxUs = 0;
 
-    snprintf(devicename, sizeof(devicename), "%s/%s", LED_DEVICE, "activate");
-    fd = TEMP_FAILURE_RETRY(open(devicename, O_RDWR));
-    if (fd < 0) {
-        ALOGE("open %s failed, errno = %d", devicename, errno);
+    /*
+     * activate is opened read-write as it's been probed, the other attributes
+     * are only written and may be write-only.
+     */
+    mActivateFd = openLedAttribute("activate", O_RDWR);
+    mStateFd = openLedAttribute("state", O_WRONLY);
+    mDurationFd = openLedAttribute("duration", O_WRONLY);
+    if (mActivateFd < 0 || mStateFd < 0 || mDurationFd < 0)
         return;
-    }
 
     mDetected = true;
 }
 
-int LedVibratorDevice::write_value(const char *file, const char *value) {
-    int fd;
+LedVibratorDevice::~LedVibratorDevice() {
+    if (mActivateFd >= 0)
+        close(mActivateFd);
+    if (mStateFd >= 0)
+        close(mStateFd);
+    if (mDurationFd >= 0)
+        close(mDurationFd);
+}
+
+/* Write a value with its terminating '\0', as the attribute was written before */
+int LedVibratorDevice::write_value(int fd, const char *value, size_t len) {
     int ret;
 
-    fd = TEMP_FAILURE_RETRY(open(file, O_WRONLY));
-    if (fd < 0) {
-        ALOGE("open %s failed, errno = %d", file, errno);
-        return -errno;
-    }
+    if (fd < 0)
+        return -ENODEV;
 
-    ret = TEMP_FAILURE_RETRY(write(fd, value, strlen(value) + 1));
+    mWrites++;
+    ret = TEMP_FAILURE_RETRY(pwrite(fd, value, len + 1, 0));
     if (ret == -1) {
         ret = -errno;
-    } else if (ret != strlen(value) + 1) {
+    } else if (ret != len + 1) {
         /* even though EAGAIN is an errno value that could be set
            by write() in some cases, none of them apply here.  So, this return
            value can be clearly identified when debugging and suggests the
@@ -421,32 +1225,54 @@ int LedVibratorDevice::write_value(const char *file, const char *value) {
     }
 
     errno = 0;
-    close(fd);
 
     return ret;
 }
 
+/* Format a duration as "<ms>\n", returns the length without the '\0' */
+static size_t formatDuration(uint32_t ms, char *buf) {
+    char digits[10];
+    size_t n = 0, len = 0;
+
+    do {
+        digits[n++] = '0' + ms % 10;
+        ms /= 10;
+    } while (ms != 0);
+
+    while (n > 0)
+        buf[len++] = digits[--n];
+    buf[len++] = '\n';
+    buf[len] = '\0';
+
+    return len;
+}
+
 int LedVibratorDevice::on(int32_t timeoutMs) {
-    char file[PATH_MAX];
-    char value[32];
+    int64_t startUs = getMonotonicUs();
+    int64_t elapsedUs;
+    char value[16];
+    size_t len;
     int ret;
 
-    snprintf(file, sizeof(file), "%s/%s", LED_DEVICE, "state");
-    ret = write_value(file, "1");
+    ret = write_value(mStateFd, "1", 1);
     if (ret < 0)
        goto error;
 
-    snprintf(file, sizeof(file), "%s/%s", LED_DEVICE, "duration");
-    snprintf(value, sizeof(value), "%u\n", timeoutMs);
-    ret = write_value(file, value);
+    len = formatDuration(timeoutMs, value);
+    ret = write_value(mDurationFd, value, len);
     if (ret < 0)
        goto error;
 
-    snprintf(file, sizeof(file), "%s/%s", LED_DEVICE, "activate");
-    ret = write_value(file, "1");
+    ret = write_value(mActivateFd, "1", 1);
     if (ret < 0)
        goto error;
 
+    elapsedUs = getMonotonicUs() - startUs;
+    mOnCount++;
+    mOnTotalUs += elapsedUs;
+    if (elapsedUs > mOnMaxUs)
+        mOnMaxUs = elapsedUs;
+
     return 0;
 
 error:
@@ -456,189 +1282,528 @@ error:
 
 int LedVibratorDevice::off()
 {
-    char file[PATH_MAX];
-    int ret;
+    return write_value(mActivateFd, "0", 1);
+}
 
-    snprintf(file, sizeof(file), "%s/%s", LED_DEVICE, "activate");
-    ret = write_value(file, "0");
-    return ret;
+void LedVibratorDevice::dump(int fd) {
+    dprintf(fd, "LedVibratorDevice detected\n");
+    dprintf(fd, "  attribute writes: %" PRIu64 "\n", mWrites);
+    dprintf(fd, "  on: %" PRIu64 ", avg %" PRId64 "us, max %" PRId64 "us\n",
+            mOnCount, mOnCount ? mOnTotalUs / (int64_t)mOnCount : 0, mOnMaxUs);
 }
 
-Vibrator::Vibrator() {
-    struct epoll_event ev;
+Vibrator::Vibrator() : timers(loop), scheduler(timers), touch(loop), completion(loop, timers),
+                       Offload(loop, timers) {
+    composeEventFd = INVALID_VALUE;
+    composeTimerFd = INVALID_VALUE;
+    composeStopSeq = 0;
+    composePending = 0;
+    composeNextCmd = nullptr;
+    effectsStarted = false;
+    composeRunning = false;
+    composeStreaming = false;
+    composeDelayDone = false;
+    composeIndex = 0;
+    composeDeadlineNs = 0;
+    composePlayLengthMs = 0;
+    composeGapCount = 0;
+    composeGapTotalUs = 0;
+    composeGapMaxUs = 0;
+    composeAdmitCount = 0;
+    composeAdmitTotalUs = 0;
+    composeAdmitMaxUs = 0;
+    planTick = 0;
+    planHits = 0;
+    planMisses = 0;
+    planHitAdmitTotalUs = 0;
+    planMissAdmitTotalUs = 0;
+    planElements = 0;
+    planSteps = 0;
+    composeStartCount = 0;
+    composeStartErrorTotalUs = 0;
+    composeStartErrorMaxUs = 0;
+    composeDriftLastUs = 0;
+    composeDriftMaxUs = 0;
+    preemptStartUs = 0;
+    preemptCount = 0;
+    preemptTotalUs = 0;
+    preemptMaxUs = 0;
+    preparedEffect = Effect::CLICK;
+    preparedStrength = EffectStrength::MEDIUM;
+    preparedExpireNs = 0;
+    prepareTtlNs = property_get_int32("ro.vendor.qti.vibrator.prepare_ttl_ms", 100) * 1000000LL;
+    /*
+     * A scale of 0 still plays at LIGHT_MAGNITUDE on this driver, so dropping the
+     * quiet primitives from the compositions is left to the devices opting in.
+     */
+    composeMinScale = property_get_int32("ro.vendor.qti.vibrator.compose_min_scale_pct", 0) / 100.0f;
+    prepareCount = 0;
+    triggerCount = 0;
+    triggerExpiredCount = 0;
+
+    RealtimePolicy::init();
+    probeCapabilities();
+    loop.start();
+    completion.start(ff.statusFd(), [this] { ff.markGone(); });
+    Offload.start();
+
+    if (ff.mSupportEffects)
+        startEffects(false);
+
+    /* Follow the haptics driver probing late or being reloaded */
+    if (!ledVib.mDetected) {
+        loop.addUeventHandler([this](const char *msg, int len __unused) {
+            handleDeviceUevent(msg);
+        });
+    }
+}
 
-    epollfd = INVALID_VALUE;
-    pipefd[0] = INVALID_VALUE;
-    pipefd[1] = INVALID_VALUE;
-    inComposition = false;
+/** Set up the effect playback of a device supporting effects
+ *
+ *  @param asyncWarmUp: run the warm-up on warmUpThread, so the uploads of a
+ *                      device found again don't stall the event loop.
+ */
+void Vibrator::startEffects(bool asyncWarmUp) {
+    /* The pinned effects are lost with the device they were uploaded to */
+    if (property_get_bool("ro.vendor.qti.vibrator.warmup", false)) {
+        if (!asyncWarmUp) {
+            warmUp();
+        } else {
+            if (warmUpThread.joinable())
+                warmUpThread.join();
+            warmUpThread = std::thread([this] { warmUp(); });
+        }
+    }
 
-    if (!ff.mSupportEffects)
+    if (effectsStarted)
         return;
+    effectsStarted = true;
+
+    /* Play the touch effect like perform(), so it supersedes the effects being tracked */
+    touch.start([this](Effect effect, EffectStrength es) {
+        int32_t playLengthMs;
+
+        performAt(effect, es, nullptr, &playLengthMs, 0);
+    });
+
+    composeEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (composeEventFd < 0) {
+        ALOGE("Failed to create compose eventfd error=%d", errno);
+        composeEventFd = INVALID_VALUE;
+        return;
+    }
+
+    composeTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (composeTimerFd < 0) {
+        ALOGE("Failed to create compose timerfd error=%d", errno);
+        goto eventfd_close;
+    }
+
+    if (loop.add(composeEventFd, EPOLLIN, [this](uint32_t) { composeEvent(); }) != 0)
+        goto timerfd_close;
+
+    if (loop.add(composeTimerFd, EPOLLIN, [this](uint32_t) { composeTimer(); }) != 0) {
+        loop.remove(composeEventFd);
+        goto timerfd_close;
+    }
+
+    return;
+
+timerfd_close:
+    close(composeTimerFd);
+    composeTimerFd = INVALID_VALUE;
+eventfd_close:
+    close(composeEventFd);
+    composeEventFd = INVALID_VALUE;
+}
+
+/** Handle the uevents of the haptics driver, called on the event loop
+ *
+ *  An input device added while the haptics device is missing or gone may be
+ *  the haptics device probed late or reloaded. What is playing on the old
+ *  device is stopped and notified, the device is looked for again and the
+ *  capabilities are probed again for the new one. A qcom-haptics uevent may
+ *  come with the driver reloading its primitives, so only the capabilities
+ *  are probed again.
+ */
+void Vibrator::handleDeviceUevent(const char *msg) {
+    int ret;
 
-    if (pipe(pipefd)) {
-        ALOGE("Failed to get pipefd error=%d", errno);
+    if (!strncmp(msg, "add@", strlen("add@")) && strstr(msg, "/input/") != NULL &&
+            strstr(msg, "/event") != NULL) {
+        if (ff.isPresent())
+            return;
+
+        ALOGD("input device added, looking for the haptics device");
+        off();
+        completion.stop();
+        ret = ff.rediscover();
+        completion.start(ff.statusFd(), [this] { ff.markGone(); });
+        if (ret <= 0)
+            return;
+
+        probeCapabilities();
+        if (ff.mSupportEffects)
+            startEffects(true);
         return;
     }
 
-    epollfd = epoll_create1(0);
-    if (epollfd < 0) {
-        ALOGE("Failed to create epoll fd error=%d", errno);
-        goto pipefd_close;
+    if (strstr(msg, "qcom-haptics") != NULL) {
+        ALOGD("qcom-haptics uevent, probing capabilities again");
+        probeCapabilities();
+    }
+}
+
+/* Pin all supported effects and primitives in the kernel ff slots */
+void Vibrator::warmUp() {
+    std::shared_ptr<const Capabilities> c = capabilities();
+    std::vector<int> ids;
+
+    for (auto e : c->effects)
+        ids.push_back(static_cast<int>(e));
+    for (auto p : c->primitives)
+        ids.push_back(static_cast<int>(p) | PRIMITIVE_ID_MASK);
+
+    ff.warmUp(ids);
+}
+
+Vibrator::~Vibrator() {
+    /* No handler may run once the members start to be destroyed */
+    loop.stop();
+    if (warmUpThread.joinable())
+        warmUpThread.join();
+
+    if (composeEventFd != INVALID_VALUE)
+        close(composeEventFd);
+    if (composeTimerFd != INVALID_VALUE)
+        close(composeTimerFd);
+    delete composeNextCmd.exchange(nullptr);
+}
+
+/* Compute the capability snapshot of the probed device */
+void Vibrator::probeCapabilities() {
+    std::shared_ptr<Capabilities> c = std::make_shared<Capabilities>();
+
+    c->caps = IVibrator::CAP_ON_CALLBACK;
+    if (!ledVib.mDetected) {
+        if (ff.mSupportGain)
+            c->caps |= IVibrator::CAP_AMPLITUDE_CONTROL;
+        if (ff.mSupportEffects) {
+            c->caps |= IVibrator::CAP_PERFORM_CALLBACK;
+            if (access("/sys/class/qcom-haptics/primitive_duration", F_OK) == 0)
+                c->caps |= IVibrator::CAP_COMPOSE_EFFECTS;
+        }
+        if (ff.mSupportExternalControl)
+            c->caps |= IVibrator::CAP_EXTERNAL_CONTROL;
+
+        if (Offload.mEnabled == 1)
+            c->effects = {Effect::CLICK, Effect::DOUBLE_CLICK, Effect::TICK, Effect::THUD,
+                          Effect::POP, Effect::HEAVY_CLICK, Effect::RINGTONE_12,
+                          Effect::RINGTONE_13, Effect::RINGTONE_14, Effect::RINGTONE_15};
+        else
+            c->effects = {Effect::CLICK, Effect::DOUBLE_CLICK, Effect::TICK, Effect::THUD,
+                          Effect::POP, Effect::HEAVY_CLICK};
     }
 
-    ev.events = EPOLLIN;
-    ev.data.fd = pipefd[0];
+    c->primitives = {
+        CompositePrimitive::NOOP,   CompositePrimitive::CLICK,
+        CompositePrimitive::THUD,   CompositePrimitive::SPIN,
+        CompositePrimitive::QUICK_RISE, CompositePrimitive::SLOW_RISE,
+        CompositePrimitive::QUICK_FALL, CompositePrimitive::LIGHT_TICK,
+        CompositePrimitive::LOW_TICK,
+    };
+
+    for (auto e : c->effects)
+        c->effectMask.set(static_cast<size_t>(e));
+    for (auto p : c->primitives)
+        c->primitiveMask.set(static_cast<size_t>(p));
+    probePrimitiveDurations(c.get());
+    if (!ledVib.mDetected)
+        ff.saveProbe(c->primitiveDurationMs);
+
+    ALOGD("QTI Vibrator capabilities: %d, %zu effects, %zu primitives",
+            c->caps, c->effects.size(), c->primitives.size());
+    std::atomic_store(&caps, std::shared_ptr<const Capabilities>(c));
+}
+
+std::shared_ptr<const Vibrator::Capabilities> Vibrator::capabilities() {
+    return std::atomic_load(&caps);
+}
+
+ndk::ScopedAStatus Vibrator::getCapabilities(int32_t* _aidl_return) {
+    *_aidl_return = capabilities()->caps;
+
+    ALOGD("QTI Vibrator reporting capabilities: %d", *_aidl_return);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Vibrator::off() {
+    uint64_t value = 1;
+    int ret;
+
+    ALOGD("QTI Vibrator off");
+    {
+        std::lock_guard<std::mutex> lock(playLock);
+
+        if (ledVib.mDetected)
+            ret = ledVib.off();
+        else
+            ret = ff.off();
+        if (ret != 0)
+            return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
+
+        completion.completeAll();
+    }
+
+    /* Stop the running composition and drop the pending one */
+    composeStopSeq++;
+    if (composeEventFd != INVALID_VALUE) {
+        ret = write(composeEventFd, &value, sizeof(value));
+        if (ret < 0) {
+            ALOGE("Failed to signal compose stop");
+            return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
+        }
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Vibrator::on(int32_t timeoutMs,
+                                const std::shared_ptr<IVibratorCallback>& callback) {
+    int ret;
+
+    ALOGD("Vibrator on for timeoutMs: %d", timeoutMs);
+    std::lock_guard<std::mutex> lock(playLock);
+
+    if (ledVib.mDetected)
+        ret = ledVib.on(timeoutMs);
+    else
+        ret = ff.on(timeoutMs);
+
+    if (ret != 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
+
+    /* The play write replaced the effects being tracked */
+    completion.completeAll();
+    if (callback != nullptr)
+        completion.track(callback, ledVib.mDetected ? INVALID_VALUE : ff.playingId(), timeoutMs);
+
+    return ndk::ScopedAStatus::ok();
+}
+
+bool Vibrator::isEffectSupported(Effect effect, EffectStrength es) {
+    std::shared_ptr<const Capabilities> c = capabilities();
+    size_t id = static_cast<size_t>(effect);
+
+    if (id >= c->effectMask.size() || !c->effectMask.test(id))
+        return false;
+
+    if (es != EffectStrength::LIGHT && es != EffectStrength::MEDIUM && es != EffectStrength::STRONG)
+        return false;
+
+    return true;
+}
+
+ndk::ScopedAStatus Vibrator::perform(Effect effect, EffectStrength es, const std::shared_ptr<IVibratorCallback>& callback, int32_t* _aidl_return) {
+    return performAt(effect, es, callback, _aidl_return, 0);
+}
+
+/* Play an effect, scheduled at scheduledNs if it's not 0 */
+ndk::ScopedAStatus Vibrator::performAt(Effect effect, EffectStrength es,
+                                       const std::shared_ptr<IVibratorCallback>& callback,
+                                       int32_t* _aidl_return, int64_t scheduledNs) {
+    long playLengthMs;
+    int ret;
+
+    ALOGD("Vibrator perform effect %d", effect);
+    if (!isEffectSupported(effect, es))
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
+
+    std::lock_guard<std::mutex> lock(playLock);
+
+    ret = ff.playEffect((static_cast<int>(effect)), es, &playLengthMs);
+    if (ret != 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
+
+    if (scheduledNs != 0)
+        scheduler.recordStart(scheduledNs);
+
+    /* The play write replaced the effects being tracked */
+    completion.completeAll();
+    if (callback != nullptr)
+        completion.track(callback, ff.playingId(), playLengthMs);
+
+    *_aidl_return = playLengthMs;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Vibrator::prepare(Effect effect, EffectStrength es) {
+    int64_t expireNs;
+    int ret;
+
+    ALOGD("Vibrator prepare effect %d", effect);
+    if (!isEffectSupported(effect, es))
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
+
+    std::lock_guard<std::mutex> lock(playLock);
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pipefd[0], &ev) == -1) {
-        ALOGE("Failed to add pipefd to epoll ctl error=%d", errno);
-        goto epollfd_close;
-    }
+    expireNs = getMonotonicNs() + prepareTtlNs;
+    ret = ff.prepareEffect(static_cast<int>(effect), es, InputFFDevice::RESERVE_PREPARE,
+                           expireNs, NULL);
+    if (ret != 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
 
-    return;
+    preparedEffect = effect;
+    preparedStrength = es;
+    preparedExpireNs = expireNs;
+    prepareCount++;
 
-epollfd_close:
-    close(epollfd);
-    epollfd = INVALID_VALUE;
-pipefd_close:
-    close(pipefd[0]);
-    close(pipefd[1]);
-    pipefd[0] = INVALID_VALUE;
-    pipefd[1] = INVALID_VALUE;
+    return ndk::ScopedAStatus::ok();
 }
 
-Vibrator::~Vibrator() {
-    if (epollfd != INVALID_VALUE)
-        close(epollfd);
-    if (pipefd[0] != INVALID_VALUE)
-        close(pipefd[0]);
-    if (pipefd[1] != INVALID_VALUE)
-        close(pipefd[1]);
-}
+ndk::ScopedAStatus Vibrator::trigger(const std::shared_ptr<IVibratorCallback>& callback,
+                                     int32_t* _aidl_return) {
+    int64_t expireNs;
+    Effect effect;
+    EffectStrength es;
 
-ndk::ScopedAStatus Vibrator::getCapabilities(int32_t* _aidl_return) {
-    *_aidl_return = IVibrator::CAP_ON_CALLBACK;
+    {
+        std::lock_guard<std::mutex> lock(playLock);
 
-    if (ledVib.mDetected) {
-        ALOGD("QTI Vibrator reporting capabilities: %d", *_aidl_return);
-        return ndk::ScopedAStatus::ok();
+        expireNs = preparedExpireNs.exchange(0);
+        effect = preparedEffect;
+        es = preparedStrength;
     }
 
-    if (ff.mSupportGain)
-        *_aidl_return |= IVibrator::CAP_AMPLITUDE_CONTROL;
-    if (ff.mSupportEffects) {
-       *_aidl_return |= IVibrator::CAP_PERFORM_CALLBACK;
-        if (access("/sys/class/qcom-haptics/primitive_duration", F_OK) == 0) {
-            *_aidl_return |= IVibrator::CAP_COMPOSE_EFFECTS;
-        }
+    if (expireNs == 0 || getMonotonicNs() > expireNs) {
+        ALOGD("No prepared effect to trigger");
+        triggerExpiredCount++;
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_ILLEGAL_STATE));
     }
-    if (ff.mSupportExternalControl)
-        *_aidl_return |= IVibrator::CAP_EXTERNAL_CONTROL;
 
-    ALOGD("QTI Vibrator reporting capabilities: %d", *_aidl_return);
-    return ndk::ScopedAStatus::ok();
+    triggerCount++;
+    return perform(effect, es, callback, _aidl_return);
 }
 
-ndk::ScopedAStatus Vibrator::off() {
+/** Play an effect at an absolute CLOCK_MONOTONIC time
+ *
+ *  The effect is uploaded and its slot reserved until the start time plus the
+ *  prepare TTL, so the scheduler thread only needs the play write at startTimeNs.
+ */
+ndk::ScopedAStatus Vibrator::scheduleEffect(Effect effect, EffectStrength es, int64_t startTimeNs,
+                                            const std::shared_ptr<IVibratorCallback>& callback,
+                                            int32_t* _aidl_return) {
+    long playLengthMs = 0;
     int ret;
-    int composeEven = STOP_COMPOSE;
 
-    ALOGD("QTI Vibrator off");
-    if (ledVib.mDetected)
-        ret = ledVib.off();
-    else
-        ret = ff.off();
+    ALOGD("Vibrator schedule effect %d at %" PRId64 "ns", effect, startTimeNs);
+    if (startTimeNs <= 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_ILLEGAL_ARGUMENT));
+
+    if (!isEffectSupported(effect, es))
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
+
+    {
+        std::lock_guard<std::mutex> lock(playLock);
+
+        /* Release the reservation of the pending effect before taking the new one */
+        scheduler.cancel();
+        ret = ff.prepareEffect(static_cast<int>(effect), es, InputFFDevice::RESERVE_SCHEDULE,
+                               startTimeNs + prepareTtlNs, &playLengthMs);
+    }
     if (ret != 0)
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
 
-    if (inComposition) {
-        ret = write(pipefd[1], &composeEven, sizeof(composeEven));
-        if (ret < 0) {
-            ALOGE("Failed to send STOP_COMPOSE event");
-            return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
-        }
-    }
+    ret = scheduler.schedule(startTimeNs, [this, effect, es, callback, startTimeNs] {
+        int32_t lengthMs;
+
+        performAt(effect, es, callback, &lengthMs, startTimeNs);
+    }, [this] {
+        ff.clearReservation(InputFFDevice::RESERVE_SCHEDULE);
+    });
+    if (ret != 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
 
+    *_aidl_return = playLengthMs;
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus Vibrator::on(int32_t timeoutMs,
-                                const std::shared_ptr<IVibratorCallback>& callback) {
+/* Start a composition at an absolute CLOCK_MONOTONIC time */
+ndk::ScopedAStatus Vibrator::scheduleCompose(const std::vector<CompositeEffect>& composite,
+                                             int64_t startTimeNs,
+                                             const std::shared_ptr<IVibratorCallback>& callback) {
+    std::shared_ptr<const ComposePlan> plan;
+    bool hit;
     int ret;
 
-    ALOGD("Vibrator on for timeoutMs: %d", timeoutMs);
-    if (ledVib.mDetected)
-        ret = ledVib.on(timeoutMs);
-    else
-        ret = ff.on(timeoutMs);
+    ALOGD("Vibrator schedule composition at %" PRId64 "ns", startTimeNs);
+    if (startTimeNs <= 0)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_ILLEGAL_ARGUMENT));
+
+    if (!ff.mSupportEffects)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
+
+    /* Compile the plan now so the compose() at the start time finds it cached */
+    ndk::ScopedAStatus valid = getComposePlan(composite, &plan, &hit);
+    if (!valid.isOk())
+        return valid;
+
+    if (!plan->steps.empty()) {
+        std::lock_guard<std::mutex> lock(playLock);
+
+        ff.preparePrimitive(static_cast<int>(plan->steps[0].primitive), plan->steps[0].scale);
+    }
 
+    ret = scheduler.schedule(startTimeNs, [this, composite, callback, startTimeNs] {
+        composeAt(composite, callback, startTimeNs);
+    });
     if (ret != 0)
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
 
-    if (callback != nullptr) {
-        std::thread([=] {
-            ALOGD("Starting on on another thread");
-            usleep(timeoutMs * 1000);
-            ALOGD("Notifying on complete");
-            if (!callback->onComplete().isOk()) {
-                ALOGE("Failed to call onComplete");
-            }
-        }).detach();
-    }
+    return ndk::ScopedAStatus::ok();
+}
 
+ndk::ScopedAStatus Vibrator::cancelScheduled() {
+    scheduler.cancel();
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus Vibrator::perform(Effect effect, EffectStrength es, const std::shared_ptr<IVibratorCallback>& callback, int32_t* _aidl_return) {
-    long playLengthMs;
+/** Arm the touch trigger
+ *
+ *  The effect is uploaded and its slot is reserved while the region is armed,
+ *  so a touch down inside the region only needs the play write.
+ */
+ndk::ScopedAStatus Vibrator::armTouchRegion(int32_t left, int32_t top, int32_t right,
+                                            int32_t bottom, Effect effect, EffectStrength es) {
     int ret;
 
-    if (ledVib.mDetected)
+    if (!touch.mEnabled)
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
 
-    ALOGD("Vibrator perform effect %d", effect);
-    if (Offload.mEnabled == 1) {
-        if ((effect < Effect::CLICK) ||
-            ((effect > Effect::HEAVY_CLICK) && (effect < Effect::RINGTONE_12)) ||
-            (effect > Effect::RINGTONE_15))
-            return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
-    }
-    else {
-        if (effect < Effect::CLICK ||  effect > Effect::HEAVY_CLICK)
-            return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
-    }
-
-    if (es != EffectStrength::LIGHT && es != EffectStrength::MEDIUM && es != EffectStrength::STRONG)
+    if (!isEffectSupported(effect, es))
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
 
-    ret = ff.playEffect((static_cast<int>(effect)), es, &playLengthMs);
+    if (left > right || top > bottom)
+        return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_ILLEGAL_ARGUMENT));
+
+    touch.disarm();
+    ret = ff.prepareEffect(static_cast<int>(effect), es, InputFFDevice::RESERVE_TOUCH,
+                           INT64_MAX, NULL);
     if (ret != 0)
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
 
-    if (callback != nullptr) {
-        std::thread([=] {
-            ALOGD("Starting perform on another thread");
-            usleep(playLengthMs * 1000);
-            ALOGD("Notifying perform complete");
-            callback->onComplete();
-        }).detach();
-    }
+    touch.arm(left, top, right, bottom, effect, es);
+    return ndk::ScopedAStatus::ok();
+}
 
-    *_aidl_return = playLengthMs;
+ndk::ScopedAStatus Vibrator::disarmTouch() {
+    touch.disarm();
+    ff.clearReservation(InputFFDevice::RESERVE_TOUCH);
     return ndk::ScopedAStatus::ok();
 }
 
 ndk::ScopedAStatus Vibrator::getSupportedEffects(std::vector<Effect>* _aidl_return) {
-    if (ledVib.mDetected)
-        return ndk::ScopedAStatus::ok();
-
-    if (Offload.mEnabled == 1)
-        *_aidl_return = {Effect::CLICK, Effect::DOUBLE_CLICK, Effect::TICK, Effect::THUD,
-                         Effect::POP, Effect::HEAVY_CLICK, Effect::RINGTONE_12,
-                         Effect::RINGTONE_13, Effect::RINGTONE_14, Effect::RINGTONE_15};
-    else
-        *_aidl_return = {Effect::CLICK, Effect::DOUBLE_CLICK, Effect::TICK, Effect::THUD,
-                         Effect::POP, Effect::HEAVY_CLICK};
-
+    *_aidl_return = capabilities()->effects;
     return ndk::ScopedAStatus::ok();
 }
 
@@ -661,6 +1826,7 @@ ndk::ScopedAStatus Vibrator::setAmplitude(float amplitude) {
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
 
     tmp = (uint8_t)(amplitude * 0xff);
+    std::lock_guard<std::mutex> lock(playLock);
     ret = ff.setAmplitude(tmp);
     if (ret != 0)
         return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_SERVICE_SPECIFIC));
@@ -691,13 +1857,7 @@ ndk::ScopedAStatus Vibrator::getCompositionSizeMax(int32_t* maxSize) {
 }
 
 ndk::ScopedAStatus Vibrator::getSupportedPrimitives(std::vector<CompositePrimitive>* supported) {
-    *supported =  {
-        CompositePrimitive::NOOP,   CompositePrimitive::CLICK,
-        CompositePrimitive::THUD,   CompositePrimitive::SPIN,
-        CompositePrimitive::QUICK_RISE, CompositePrimitive::SLOW_RISE,
-        CompositePrimitive::QUICK_FALL, CompositePrimitive::LIGHT_TICK,
-        CompositePrimitive::LOW_TICK,
-    };
+    *supported = capabilities()->primitives;
     return ndk::ScopedAStatus::ok();
 }
 
@@ -762,99 +1922,358 @@ close_fd:
     return ret;
 }
 
-ndk::ScopedAStatus Vibrator::getPrimitiveDuration(CompositePrimitive primitive,
-                                                  int32_t* durationMs) {
+static int queryPrimitiveDuration(CompositePrimitive primitive, int32_t* durationMs) {
     uint32_t primitive_id = static_cast<uint32_t>(primitive);
-    int ret = 0;
 
 #ifdef USE_EFFECT_STREAM
     primitive_id |= PRIMITIVE_ID_MASK ;
     const struct effect_stream *stream;
     stream = get_effect_stream(primitive_id);
+    *durationMs = 0;
     if (stream != NULL && stream->play_rate_hz != 0)
         *durationMs = ((stream->length * 1000) / stream->play_rate_hz) + 1;
 
-    ALOGD("primitive-%d duration is %dms", primitive, *durationMs);
-    return ndk::ScopedAStatus::ok();
+    return 0;
 #endif
 
-    ret = getPrimitiveDurationFromSysfs(primitive_id, durationMs);
-    if (ret < 0)
-        return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
+    return getPrimitiveDurationFromSysfs(primitive_id, durationMs);
+}
+
+/*
+ * Fill the duration table of the supported primitives, a primitive whose
+ * duration can't be read is left at INVALID_VALUE and reported unsupported.
+ * The stream builds compute the durations from the built-in streams, so they
+ * don't depend on the primitive_duration sysfs node of the compositions.
+ */
+void Vibrator::probePrimitiveDurations(Capabilities *c) {
+    int32_t durationMs;
+
+    c->primitiveDurationMs.fill(INVALID_VALUE);
+#ifndef USE_EFFECT_STREAM
+    if (!(c->caps & IVibrator::CAP_COMPOSE_EFFECTS))
+        return;
+#endif
+
+    if (ff.cachedDurations(&c->primitiveDurationMs)) {
+        ALOGD("primitive durations are taken from probe cache");
+        return;
+    }
+
+    for (auto p : c->primitives) {
+        if (queryPrimitiveDuration(p, &durationMs) < 0)
+            continue;
+
+        c->primitiveDurationMs[static_cast<size_t>(p)] = durationMs;
+        ALOGD("primitive-%d duration is %dms", p, durationMs);
+    }
+}
+
+ndk::ScopedAStatus Vibrator::getPrimitiveDuration(CompositePrimitive primitive,
+                                                  int32_t* durationMs) {
+    std::shared_ptr<const Capabilities> c = capabilities();
+    size_t id = static_cast<size_t>(primitive);
 
-    ALOGD("primitive-%d duration is %dms", primitive, *durationMs);
+    if (id >= c->primitiveDurationMs.size() || c->primitiveDurationMs[id] == INVALID_VALUE)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
 
+    *durationMs = c->primitiveDurationMs[id];
     return ndk::ScopedAStatus::ok();
 }
 
-void Vibrator::composePlayThread(Vibrator *vibrator,
-                            const std::vector<CompositeEffect>& composite,
-                            const std::shared_ptr<IVibratorCallback>& callback){
-    struct epoll_event events;
-    long playLengthMs = 0;
-    int nfd = 0;
-    int status = 0;
-    int ret = 0;
+/* Track the time from the end of a wait to the start of the next primitive */
+void Vibrator::recordComposeGap(int64_t gapUs) {
+    int64_t max = composeGapMaxUs;
+
+    composeGapCount++;
+    composeGapTotalUs += gapUs;
+    while (gapUs > max && !composeGapMaxUs.compare_exchange_weak(max, gapUs));
+}
+
+/* Arm the compose timer for the absolute CLOCK_MONOTONIC deadlineNs, 0 to disarm it */
+void Vibrator::armComposeTimer(int64_t deadlineNs) {
+    struct itimerspec its;
+
+    /* A zero it_value disarms the timer */
+    memset(&its, 0, sizeof(its));
+    if (deadlineNs != 0) {
+        its.it_value.tv_sec = deadlineNs / 1000000000LL;
+        its.it_value.tv_nsec = deadlineNs % 1000000000LL;
+    }
+
+    if (timerfd_settime(composeTimerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        ALOGE("Failed to arm compose timer, error=%d", errno);
+}
+
+/* Track the time compose() takes to get the plan of a composition before queuing it */
+void Vibrator::recordComposeAdmission(int64_t elapsedUs, bool hit) {
+    int64_t max = composeAdmitMaxUs;
+
+    composeAdmitCount++;
+    composeAdmitTotalUs += elapsedUs;
+    if (hit) {
+        planHits++;
+        planHitAdmitTotalUs += elapsedUs;
+    } else {
+        planMisses++;
+        planMissAdmitTotalUs += elapsedUs;
+    }
+    while (elapsedUs > max && !composeAdmitMaxUs.compare_exchange_weak(max, elapsedUs));
+}
+
+/* Track how late a primitive starts against the composition timeline */
+void Vibrator::recordComposeStartError(int64_t errorUs) {
+    int64_t max = composeStartErrorMaxUs;
+
+    composeStartCount++;
+    composeStartErrorTotalUs += errorUs;
+    while (errorUs > max && !composeStartErrorMaxUs.compare_exchange_weak(max, errorUs));
+}
+
+#ifdef USE_EFFECT_STREAM
+/** Render a composition into a single effect stream
+ *
+ *  The samples of each primitive are scaled as playPrimitive() would do with the
+ *  magnitude, and the delay before each primitive is filled with zero samples.
+ *  Fail if a primitive has no stream, if the primitives are played at different
+ *  rates, or if the rendered stream exceeds ComposeStreamMaxSamples.
+ */
+static int renderComposition(const std::vector<CompositeEffect>& composite,
+                             std::vector<int8_t>& samples, uint32_t *playRateHz) {
+    const struct effect_stream *stream;
+    uint32_t rate = 0;
+    uint64_t len, delay;
+    int factor, sample;
 
-    ALOGD("start a new thread for composeEffect");
+    samples.clear();
     for (auto& e : composite) {
-        if (e.delayMs) {
-            nfd = epoll_wait(vibrator->epollfd, &events, 1, e.delayMs);
-            if ((nfd == -1) && (errno != EINTR)) {
-                ALOGE("Failed to wait delayMs, error=%d", errno);
-                break;
-            }
+        stream = get_effect_stream(static_cast<uint32_t>(e.primitive) | PRIMITIVE_ID_MASK);
+        if (stream == NULL || stream->play_rate_hz == 0)
+            return -1;
+
+        if (rate == 0)
+            rate = stream->play_rate_hz;
+        else if (rate != stream->play_rate_hz)
+            return -1;
+
+        delay = (uint64_t)e.delayMs * rate / 1000;
+        len = samples.size() + delay + stream->length;
+        if (len > ComposeStreamMaxSamples)
+            return -1;
+
+        samples.reserve(len);
+        samples.insert(samples.end(), delay, 0);
+        factor = primitiveMagnitude(e.scale);
+        for (uint32_t i = 0; i < stream->length; i++) {
+            sample = stream->data[i] * factor / STRONG_MAGNITUDE;
+            samples.push_back((int8_t)std::max(INT8_MIN, std::min(INT8_MAX, sample)));
+        }
+    }
 
-            if (nfd > 0) {
-                /* It's supposed that STOP_COMPOSE command is received so quit the composition */
-                ret = read(vibrator->pipefd[0], &status, sizeof(int));
-                if (ret < 0) {
-                    ALOGE("Failed to read stop status from pipe(delayMs), status = %d", status);
-                    break;
-                }
-                if (status == STOP_COMPOSE)
-                    break;
-            }
+    if (samples.empty())
+        return -1;
+
+    *playRateHz = rate;
+    return 0;
+}
+
+/* Play the stream rendered in the plan, return false to fall back to primitives */
+bool Vibrator::playComposedStream(const ComposePlan& plan, long *playLengthMs) {
+    struct effect_stream stream;
+
+    if (plan.samples.empty())
+        return false;
+
+    stream.effect_id = ComposeStreamId;
+    stream.play_rate_hz = plan.playRateHz;
+    stream.length = plan.samples.size();
+    stream.data = plan.samples.data();
+
+    std::lock_guard<std::mutex> lock(playLock);
+
+    return ff.playStream(&stream, playLengthMs) == 0;
+}
+#endif
+
+/*
+ * The compositions are played on the event loop. Each primitive starts at an
+ * absolute time following the previous one by its play length and the delay,
+ * so that the wake-up and ioctl latencies of an element don't push back the
+ * rest of the composition.
+ */
+void Vibrator::composeStart() {
+    composeRunning = true;
+    composeStreaming = false;
+    composeDelayDone = false;
+    composeIndex = 0;
+    composePlayLengthMs = 0;
+    composeDeadlineNs = getMonotonicNs();
+
+#ifdef USE_EFFECT_STREAM
+    if (playComposedStream(*composeCmd.plan, &composePlayLengthMs)) {
+        if (composeCmd.scheduledNs != 0)
+            scheduler.recordStart(composeCmd.scheduledNs);
+        composeStreaming = true;
+        composeDeadlineNs += (composePlayLengthMs + composeCmd.plan->tailDelayMs) * 1000000LL;
+        armComposeTimer(composeDeadlineNs);
+        return;
+    }
+#endif
+
+    composeStep();
+}
+
+/* Wait for the delay of the current element or play it, and wait for it to stop */
+void Vibrator::composeStep() {
+    const std::vector<CompositeEffect>& composite = composeCmd.plan->steps;
+    int64_t startUs;
+
+    if (composeIndex == composite.size()) {
+        /* Wait for the delays folded after the last primitive */
+        if (composeCmd.plan->tailDelayMs && !composeDelayDone) {
+            composeDelayDone = true;
+            composeDeadlineNs += composeCmd.plan->tailDelayMs * 1000000LL;
+            armComposeTimer(composeDeadlineNs);
+            return;
         }
 
-        vibrator->ff.playPrimitive((static_cast<int>(e.primitive)), e.scale, &playLengthMs);
-        nfd = epoll_wait(vibrator->epollfd, &events, 1, playLengthMs);
-        if (nfd == -1 && (errno != EINTR)) {
-            ALOGE("Failed to wait sleep playLengthMs, error=%d", errno);
-            break;
+        composeFinish(false);
+        return;
+    }
+
+    auto& e = composite[composeIndex];
+    if (e.delayMs && !composeDelayDone) {
+        composeDelayDone = true;
+        composeDeadlineNs += e.delayMs * 1000000LL;
+        armComposeTimer(composeDeadlineNs);
+        return;
+    }
+
+    startUs = getMonotonicUs();
+    {
+        std::lock_guard<std::mutex> lock(playLock);
+
+        ff.playPrimitive((static_cast<int>(e.primitive)), e.scale, &composePlayLengthMs);
+    }
+    if (composeIndex == 0 && composeCmd.scheduledNs != 0)
+        scheduler.recordStart(composeCmd.scheduledNs);
+    if (composeIndex != 0 || composeDelayDone) {
+        recordComposeGap(getMonotonicUs() - startUs);
+        recordComposeStartError(startUs - composeDeadlineNs / 1000);
+    }
+
+    /* Upload the next primitive while this one is playing */
+    if (composeIndex + 1 < composite.size()) {
+        std::lock_guard<std::mutex> lock(playLock);
+
+        ff.preparePrimitive(static_cast<int>(composite[composeIndex + 1].primitive),
+                            composite[composeIndex + 1].scale);
+    }
+
+    composeIndex++;
+    composeDelayDone = false;
+    composeDeadlineNs += composePlayLengthMs * 1000000LL;
+    armComposeTimer(composeDeadlineNs);
+}
+
+/* Notify the end of the current composition, stopped or not */
+void Vibrator::composeFinish(bool stopped) {
+    int64_t nowUs = getMonotonicUs();
+    int64_t errorUs, startUs, max;
+
+    if (composeRunning) {
+        armComposeTimer(0);
+
+        /* Drift of the whole composition from its timeline */
+        if (!stopped) {
+            errorUs = nowUs - composeDeadlineNs / 1000;
+            composeDriftLastUs = errorUs;
+            if (errorUs > composeDriftMaxUs)
+                composeDriftMaxUs = errorUs;
         }
+    }
 
-        if (nfd > 0) {
-            /* It's supposed that STOP_COMPOSE command is received so quit the composition */
-            ret = read(vibrator->pipefd[0], &status, sizeof(int));
-            if (ret < 0) {
-                ALOGE("Failed to read stop status from pipe(playLengthMs), status = %d", status);
-                break;
-            }
-            if (status == STOP_COMPOSE)
-                break;
+    ALOGD("Notifying composite complete, playlength= %ld", composePlayLengthMs);
+    if (composeCmd.callback)
+        composeCmd.callback->onComplete();
+
+    composeCmd = ComposeCommand();
+    composeRunning = false;
+    composePending--;
+
+    /* Time from compose() preempting the composition to its end */
+    startUs = preemptStartUs.exchange(0);
+    if (stopped && startUs != 0) {
+        errorUs = nowUs - startUs;
+        max = preemptMaxUs;
+        preemptCount++;
+        preemptTotalUs += errorUs;
+        while (errorUs > max && !preemptMaxUs.compare_exchange_weak(max, errorUs));
+    }
+}
+
+/* Start the pending composition, if it was stopped before it started it is only notified */
+void Vibrator::composeNext() {
+    std::unique_ptr<ComposeCommand> next;
+
+    while (!composeRunning) {
+        next.reset(composeNextCmd.exchange(nullptr));
+        if (!next)
+            return;
+
+        composeCmd = std::move(*next);
+        if (composeStopSeq != composeCmd.stopSeq) {
+            composeFinish(true);
+            continue;
         }
+
+        composeStart();
     }
+}
+
+/* A composition is queued or stopped */
+void Vibrator::composeEvent() {
+    uint64_t value;
+
+    if (read(composeEventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        ALOGE("Failed to read compose eventfd, error=%d", errno);
 
-    ALOGD("Notifying composite complete, playlength= %ld", playLengthMs);
-    if (callback)
-        callback->onComplete();
+    if (composeRunning && composeStopSeq != composeCmd.stopSeq)
+        composeFinish(true);
 
-    vibrator->inComposition = false;
+    composeNext();
 }
 
-ndk::ScopedAStatus Vibrator::compose(const std::vector<CompositeEffect>& composite,
-                                     const std::shared_ptr<IVibratorCallback>& callback) {
-    int status, nfd = 0, durationMs = 0, timeoutMs = 0;
-    struct epoll_event events;
+/* The deadline of the current composition step is reached */
+void Vibrator::composeTimer() {
+    uint64_t value;
+
+    if (read(composeTimerFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        ALOGE("Failed to read compose timerfd, error=%d", errno);
+
+    if (!composeRunning || getMonotonicNs() < composeDeadlineNs)
+        return;
+
+    if (composeStopSeq != composeCmd.stopSeq)
+        composeFinish(true);
+    else if (composeStreaming)
+        composeFinish(false);
+    else
+        composeStep();
+
+    composeNext();
+}
+
+/* Check the composition and sum up its play length in totalMs */
+ndk::ScopedAStatus Vibrator::validateComposition(const std::vector<CompositeEffect>& composite,
+                                                 int *totalMs) {
+    std::shared_ptr<const Capabilities> c = capabilities();
+    size_t id;
 
+    *totalMs = 0;
     if (composite.size() > ComposeSizeMax) {
         return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
     }
 
-    std::vector<CompositePrimitive> supported;
-    getSupportedPrimitives(&supported);
-
     for (auto& e : composite) {
         if (e.delayMs > ComposeDelayMaxMs) {
             return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
@@ -862,45 +2281,214 @@ ndk::ScopedAStatus Vibrator::compose(const std::vector<CompositeEffect>& composi
         if (e.scale < 0.0f || e.scale > 1.0f) {
             return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
         }
-        if (std::find(supported.begin(), supported.end(), e.primitive) == supported.end()) {
+        id = static_cast<size_t>(e.primitive);
+        if (id >= c->primitiveMask.size() || !c->primitiveMask.test(id)) {
             return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
         }
 
-        getPrimitiveDuration(e.primitive, &durationMs);
-        timeoutMs += durationMs + e.delayMs;
+        if (c->primitiveDurationMs[id] > 0)
+            *totalMs += c->primitiveDurationMs[id];
+        *totalMs += e.delayMs;
     }
 
-    /*
-     * wait for 2 times of the play length timeout to make sure last play has been
-     * terminated successfully.
-     */
-    timeoutMs = (timeoutMs + 10) * 2;
-    /* Stop previous composition if it has not yet been completed */
-    if (inComposition) {
-        ALOGD("Last composePlayThread has not done yet, stop it manually");
-        off();
+    return ndk::ScopedAStatus::ok();
+}
+
+/* FNV-1a hash of the elements of a composition */
+static uint64_t hashComposition(const std::vector<CompositeEffect>& composite) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t words[3];
+    const uint8_t *p;
+
+    for (auto& e : composite) {
+        words[0] = static_cast<uint32_t>(e.primitive);
+        memcpy(&words[1], &e.scale, sizeof(words[1]));
+        words[2] = static_cast<uint32_t>(e.delayMs);
+
+        p = reinterpret_cast<const uint8_t *>(words);
+        for (size_t i = 0; i < sizeof(words); i++) {
+            hash ^= p[i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+static bool sameComposition(const std::vector<CompositeEffect>& a,
+                            const std::vector<CompositeEffect>& b) {
+    if (a.size() != b.size())
+        return false;
 
-        while (inComposition && timeoutMs--)
-            usleep(1000);
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].primitive != b[i].primitive || a[i].scale != b[i].scale ||
+            a[i].delayMs != b[i].delayMs)
+            return false;
+    }
+
+    return true;
+}
+
+/** Optimize a validated composition into the steps to play
+ *
+ *  The NOOP primitives which don't play anything and the primitives quieter
+ *  than composeMinScale are dropped, their delay and duration are added to the
+ *  delay of the next primitive so the rest of the composition keeps its
+ *  timing, and the chains of delays become a single wait. The wait after the
+ *  last primitive is returned in tailDelayMs.
+ */
+void Vibrator::optimizeComposition(const Capabilities& c,
+                                   const std::vector<CompositeEffect>& composite,
+                                   std::vector<CompositeEffect>& steps, int32_t *tailDelayMs) {
+    int32_t pendingMs = 0, durationMs;
+
+    steps.clear();
+    for (auto& e : composite) {
+        durationMs = c.primitiveDurationMs[static_cast<size_t>(e.primitive)];
+        if (e.primitive == CompositePrimitive::NOOP && durationMs <= 0) {
+            pendingMs += e.delayMs;
+            continue;
+        }
+        if (e.scale < composeMinScale && durationMs > 0) {
+            pendingMs += e.delayMs + durationMs;
+            continue;
+        }
+
+        steps.push_back(e);
+        steps.back().delayMs += pendingMs;
+        pendingMs = 0;
+    }
+
+    *tailDelayMs = pendingMs;
+}
 
-        if (timeoutMs == 0) {
-            ALOGE("wait for last composePlayThread done timeout");
-            return ndk::ScopedAStatus::fromExceptionCode(EX_SERVICE_SPECIFIC);
+/** Get the compiled plan of a composition
+ *
+ *  The plans are cached by the content of the composition, so a composition
+ *  played again is neither validated nor rendered again. A plan compiled
+ *  against older capabilities is compiled again. The least recently used plan
+ *  is evicted when the cache is full.
+ */
+ndk::ScopedAStatus Vibrator::getComposePlan(const std::vector<CompositeEffect>& composite,
+                                            std::shared_ptr<const ComposePlan> *plan,
+                                            bool *hit) {
+    std::shared_ptr<const Capabilities> c = capabilities();
+    uint64_t hash = hashComposition(composite);
+    PlanEntry *victim = NULL;
+    int totalMs;
+
+    {
+        std::lock_guard<std::mutex> lock(planLock);
+
+        for (auto& entry : planCache) {
+            if (entry.plan->hash != hash || entry.plan->caps != c ||
+                !sameComposition(entry.plan->composite, composite))
+                continue;
+
+            entry.lastUsed = ++planTick;
+            *plan = entry.plan;
+            *hit = true;
+            return ndk::ScopedAStatus::ok();
         }
+    }
+
+    *hit = false;
+    ndk::ScopedAStatus valid = validateComposition(composite, &totalMs);
+    if (!valid.isOk())
+        return valid;
+
+    auto p = std::make_shared<ComposePlan>();
+    p->hash = hash;
+    p->composite = composite;
+    p->caps = c;
+    p->totalMs = totalMs;
+    optimizeComposition(*c, composite, p->steps, &p->tailDelayMs);
+    planElements += composite.size();
+    planSteps += p->steps.size();
+#ifdef USE_EFFECT_STREAM
+    /* An empty stream makes the composition played primitive by primitive */
+    if (renderComposition(p->steps, p->samples, &p->playRateHz) != 0)
+        p->samples.clear();
+#endif
 
-        /* Read the pipe again to remove any stale data before triggering a new play */
-        nfd = epoll_wait(epollfd, &events, 1, 0);
-        if (nfd == -1 && (errno != EINTR)) {
-            ALOGE("Failed to wait sleep playLengthMs, error=%d", errno);
-            return ndk::ScopedAStatus::fromExceptionCode(EX_SERVICE_SPECIFIC);
+    std::lock_guard<std::mutex> lock(planLock);
+
+    if (planCache.size() < ComposePlanCacheSize) {
+        planCache.push_back(PlanEntry());
+        victim = &planCache.back();
+    } else {
+        for (auto& entry : planCache) {
+            if (victim == NULL || entry.lastUsed < victim->lastUsed)
+                victim = &entry;
         }
-        if (nfd > 0)
-            read(pipefd[0], &status, sizeof(int));
     }
 
-    inComposition = true;
-    composeThread = std::thread(composePlayThread, this, composite, callback);
-    composeThread.detach();
+    victim->plan = p;
+    victim->lastUsed = ++planTick;
+    *plan = p;
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus Vibrator::compose(const std::vector<CompositeEffect>& composite,
+                                     const std::shared_ptr<IVibratorCallback>& callback) {
+    return composeAt(composite, callback, 0);
+}
+
+/* Queue a composition, scheduled at scheduledNs if it's not 0 */
+ndk::ScopedAStatus Vibrator::composeAt(const std::vector<CompositeEffect>& composite,
+                                       const std::shared_ptr<IVibratorCallback>& callback,
+                                       int64_t scheduledNs) {
+    std::shared_ptr<const ComposePlan> plan;
+    std::unique_ptr<ComposeCommand> dropped;
+    ComposeCommand cmd;
+    uint64_t value = 1;
+    int64_t startUs = getMonotonicUs();
+    bool hit;
+
+    ndk::ScopedAStatus valid = getComposePlan(composite, &plan, &hit);
+    if (!valid.isOk())
+        return valid;
+    recordComposeAdmission(getMonotonicUs() - startUs, hit);
+    ALOGD("Vibrator compose %zu primitives, %dms, plan cache %s",
+          composite.size(), plan->totalMs, hit ? "hit" : "miss");
+
+    if (composeEventFd == INVALID_VALUE)
+        return ndk::ScopedAStatus::fromExceptionCode(EX_SERVICE_SPECIFIC);
+
+    /* compose() is also called from the timer tasks, serialize the preemptions */
+    std::lock_guard<std::mutex> lock(composeLock);
+
+    /*
+     * Stop previous composition if it has not yet been completed, the event
+     * loop notifies it before starting the new one.
+     */
+    if (composePending > 0) {
+        ALOGD("Last composition has not done yet, stop it manually");
+        preemptStartUs = getMonotonicUs();
+        off();
+    }
+
+    cmd.plan = std::move(plan);
+    cmd.callback = callback;
+    cmd.stopSeq = composeStopSeq;
+    cmd.scheduledNs = scheduledNs;
+
+    /*
+     * A composition the event loop didn't start yet is superseded by this one,
+     * it's only notified like the compositions stopped before they started.
+     */
+    composePending++;
+    dropped.reset(composeNextCmd.exchange(new ComposeCommand(std::move(cmd))));
+    if (dropped) {
+        ALOGD("Pending composition is replaced before it started");
+        composePending--;
+        if (dropped->callback)
+            dropped->callback->onComplete();
+    }
+
+    if (write(composeEventFd, &value, sizeof(value)) < 0)
+        ALOGE("Failed to signal new composition, errno = %d", errno);
 
     ALOGD("trigger composition successfully");
     return ndk::ScopedAStatus::ok();
@@ -956,6 +2544,57 @@ ndk::ScopedAStatus Vibrator::composePwle(const std::vector<PrimitivePwle> &compo
     return ndk::ScopedAStatus(AStatus_fromExceptionCode(EX_UNSUPPORTED_OPERATION));
 }
 
+binder_status_t Vibrator::dump(int fd, const char** args __unused, uint32_t numArgs __unused) {
+    if (ledVib.mDetected) {
+        ledVib.dump(fd);
+        completion.dump(fd);
+        timers.dump(fd);
+        return STATUS_OK;
+    }
+
+    ff.dump(fd);
+    completion.dump(fd);
+
+    dprintf(fd, "Composition:\n");
+    dprintf(fd, "  inter-primitive gaps: %" PRId64 ", avg %" PRId64 "us, max %" PRId64 "us\n",
+            composeGapCount.load(),
+            composeGapCount ? composeGapTotalUs / composeGapCount : 0,
+            composeGapMaxUs.load());
+    dprintf(fd, "  admission: %" PRId64 ", avg %" PRId64 "us, max %" PRId64 "us\n",
+            composeAdmitCount.load(),
+            composeAdmitCount ? composeAdmitTotalUs / composeAdmitCount : 0,
+            composeAdmitMaxUs.load());
+    dprintf(fd, "  plan cache hits: %" PRId64 ", misses: %" PRId64 ", hit rate %" PRId64 "%%\n",
+            planHits.load(), planMisses.load(),
+            composeAdmitCount ? planHits * 100 / composeAdmitCount : 0);
+    dprintf(fd, "  admission on hit avg %" PRId64 "us, on miss avg %" PRId64 "us\n",
+            planHits ? planHitAdmitTotalUs / planHits : 0,
+            planMisses ? planMissAdmitTotalUs / planMisses : 0);
+    dprintf(fd, "  optimized plans: %" PRId64 " elements played as %" PRId64 " steps\n",
+            planElements.load(), planSteps.load());
+    dprintf(fd, "  primitive start error: avg %" PRId64 "us, max %" PRId64 "us\n",
+            composeStartCount ? composeStartErrorTotalUs / composeStartCount : 0,
+            composeStartErrorMaxUs.load());
+    dprintf(fd, "  timeline drift: last %" PRId64 "us, max %" PRId64 "us\n",
+            composeDriftLastUs.load(), composeDriftMaxUs.load());
+    dprintf(fd, "  preemptions: %" PRId64 ", stop handoff avg %" PRId64 "us, max %" PRId64 "us\n",
+            preemptCount.load(),
+            preemptCount ? preemptTotalUs / preemptCount : 0,
+            preemptMaxUs.load());
+
+    dprintf(fd, "Prepared effects:\n");
+    dprintf(fd, "  prepared: %" PRId64 ", triggered: %" PRId64 ", expired: %" PRId64 "\n",
+            prepareCount.load(), triggerCount.load(), triggerExpiredCount.load());
+
+    loop.dump(fd);
+    timers.dump(fd);
+    scheduler.dump(fd);
+    touch.dump(fd);
+    RealtimePolicy::dump(fd);
+    dprintf(fd, "HAL threads: %d\n", countThreads());
+    return STATUS_OK;
+}
+
 }  // namespace vibrator
 }  // namespace hardware
 }  // namespace android
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.completion"
+
+#include <inttypes.h>
+#include <linux/input.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+#define INVALID_VALUE           -1
+#define STATUS_EVENT_BATCH      16
+/*
+ * When EV_FF_STATUS is supported, the estimated play length is only a fallback
+ * in case the stop is never reported, so give the driver some time to report it.
+ */
+#define FALLBACK_MARGIN_MS      50
+
+static int64_t getMonotonicNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+CompletionTracker::CompletionTracker(EventLoop& loop, TimerQueue& timers)
+        : mLoop(loop), mTimers(timers) {
+    mStatusFd = INVALID_VALUE;
+    mStatusCompletions = 0;
+    mFallbackCompletions = 0;
+    mStoppedCompletions = 0;
+    mErrorTotalUs = 0;
+    mErrorMaxUs = 0;
+}
+
+CompletionTracker::~CompletionTracker() {
+    if (mStatusFd != INVALID_VALUE)
+        mLoop.remove(mStatusFd);
+}
+
+/** Listen to the EV_FF_STATUS events of statusFd, INVALID_VALUE if unsupported
+ *
+ *  @param onGone: called on the event loop when the device hangs up, once
+ *                 statusFd is no longer watched.
+ */
+int CompletionTracker::start(int statusFd, std::function<void()> onGone) {
+    if (statusFd == INVALID_VALUE)
+        return 0;
+
+    mOnGone = std::move(onGone);
+    if (mLoop.add(statusFd, EPOLLIN, [this](uint32_t events) { handleStatus(events); }) != 0) {
+        ALOGE("Failed to watch ff status");
+        return -1;
+    }
+
+    mStatusFd = statusFd;
+    ALOGI("completion callbacks follow EV_FF_STATUS");
+    return 0;
+}
+
+/* Stop listening to statusFd, before the device it belongs to is closed */
+void CompletionTracker::stop() {
+    int fd = mStatusFd.exchange(INVALID_VALUE);
+
+    if (fd != INVALID_VALUE)
+        mLoop.remove(fd);
+}
+
+/** Track the completion of an effect
+ *
+ *  The effects still pending are left to the caller, which completes them
+ *  with completeAll() after the play write replaced them in the driver.
+ *
+ *  @param callback:     callback to be notified when the effect is done.
+ *  @param id:           kernel id of the played effect, INVALID_VALUE if the
+ *                       stop of the effect can't be reported.
+ *  @param playLengthMs: estimated play length of the effect.
+ */
+void CompletionTracker::track(const std::shared_ptr<IVibratorCallback>& callback, int16_t id,
+                              long playLengthMs) {
+    std::shared_ptr<Completion> c = std::make_shared<Completion>();
+    bool watched = mStatusFd != INVALID_VALUE && id != INVALID_VALUE;
+    long fallbackMs = playLengthMs + (watched ? FALLBACK_MARGIN_MS : 0);
+
+    c->callback = callback;
+    c->id = watched ? id : INVALID_VALUE;
+    c->startNs = getMonotonicNs();
+    c->expectedStopNs = c->startNs + playLengthMs * 1000000LL;
+    c->timerId = 0;
+    c->done = false;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mPending.push_back(c);
+    c->timerId = mTimers.post(c->startNs + fallbackMs * 1000000LL, [this, c] {
+        if (c->done.exchange(true))
+            return;
+        remove(c);
+
+        mFallbackCompletions++;
+        ALOGD("Notifying complete after estimated play length");
+        if (!c->callback->onComplete().isOk())
+            ALOGE("Failed to call onComplete");
+    });
+}
+
+/* Complete all the pending effects right away, called once they are stopped or replaced */
+void CompletionTracker::completeAll() {
+    std::vector<std::shared_ptr<Completion>> stopped;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        stopped.swap(mPending);
+        for (auto& c : stopped)
+            mTimers.cancel(c->timerId);
+    }
+
+    for (auto& c : stopped) {
+        if (c->done.exchange(true))
+            continue;
+
+        mStoppedCompletions++;
+        if (!c->callback->onComplete().isOk())
+            ALOGE("Failed to call onComplete");
+    }
+}
+
+void CompletionTracker::remove(const std::shared_ptr<Completion>& c) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for (auto it = mPending.begin(); it != mPending.end(); it++) {
+        if (*it == c) {
+            mPending.erase(it);
+            break;
+        }
+    }
+}
+
+/*
+ * Complete the effects played with the id before it stopped, the stop of an
+ * earlier play of the same effect must not complete the later play.
+ */
+void CompletionTracker::complete(int16_t id, int64_t stopNs) {
+    std::vector<std::shared_ptr<Completion>> stopped;
+    int64_t errorUs, max;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        for (auto it = mPending.begin(); it != mPending.end();) {
+            if ((*it)->id == id && (*it)->startNs <= stopNs) {
+                mTimers.cancel((*it)->timerId);
+                stopped.push_back(*it);
+                it = mPending.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    for (auto& c : stopped) {
+        if (c->done.exchange(true))
+            continue;
+
+        errorUs = llabs(stopNs - c->expectedStopNs) / 1000;
+        mStatusCompletions++;
+        mErrorTotalUs += errorUs;
+        max = mErrorMaxUs;
+        while (errorUs > max && !mErrorMaxUs.compare_exchange_weak(max, errorUs));
+
+        ALOGD("Notifying complete on effect %d stopped, %" PRId64 "us off the estimate",
+                id, errorUs);
+        if (!c->callback->onComplete().isOk())
+            ALOGE("Failed to call onComplete");
+    }
+}
+
+/*
+ * Read the EV_FF_STATUS events, called on the event loop thread. A removed
+ * device stays readable with EPOLLHUP and read() failing with ENODEV, so it's
+ * no longer watched, and what it played is completed.
+ */
+void CompletionTracker::handleStatus(uint32_t pollEvents) {
+    struct input_event events[STATUS_EVENT_BATCH];
+    ssize_t len;
+    size_t i;
+
+    len = read(mStatusFd, events, sizeof(events));
+    if (len < 0 && errno == EAGAIN && !(pollEvents & (EPOLLHUP | EPOLLERR)))
+        return;
+
+    if (len <= 0) {
+        ALOGE("ff status is gone, errno = %d", len < 0 ? errno : 0);
+        stop();
+        completeAll();
+        if (mOnGone)
+            mOnGone();
+        return;
+    }
+
+    for (i = 0; i < len / sizeof(events[0]); i++) {
+        if (events[i].type != EV_FF_STATUS || events[i].value != FF_STATUS_STOPPED)
+            continue;
+
+        complete(events[i].code, events[i].time.tv_sec * 1000000000LL +
+                events[i].time.tv_usec * 1000LL);
+    }
+}
+
+void CompletionTracker::dump(int fd) {
+    int64_t completions = mStatusCompletions;
+
+    dprintf(fd, "Completion callbacks:\n");
+    dprintf(fd, "  EV_FF_STATUS: %s\n",
+            mStatusFd != INVALID_VALUE ? "supported" : "unsupported");
+    dprintf(fd, "  completed on stop: %" PRId64 ", on estimate: %" PRId64
+            ", on off/supersede: %" PRId64 "\n",
+            completions, mFallbackCompletions.load(), mStoppedCompletions.load());
+    dprintf(fd, "  error from estimate avg %" PRId64 "us, max %" PRId64 "us\n",
+            completions ? mErrorTotalUs / completions : 0, mErrorMaxUs.load());
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.eventloop"
+
+#include <cutils/uevent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+#define INVALID_VALUE           -1
+#define EPOLL_EVENT_BATCH       8
+#define UEVENT_MSG_LEN          1024
+#define UEVENT_BUF_SIZE         (64 * 1024)
+
+static int64_t getMonotonicUs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+EventLoop::EventLoop() {
+    struct epoll_event ev;
+
+    mUeventFd = INVALID_VALUE;
+    mExit = false;
+    mWakeups = 0;
+    mEvents = 0;
+    mHandleTotalUs = 0;
+    mHandleMaxUs = 0;
+
+    mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEventFd < 0 || mEpollFd < 0) {
+        ALOGE("Failed to create event loop fds, errno = %d", errno);
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = mEventFd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &ev) == -1)
+        ALOGE("Failed to add eventfd to epoll, errno = %d", errno);
+}
+
+EventLoop::~EventLoop() {
+    stop();
+
+    if (mUeventFd != INVALID_VALUE)
+        close(mUeventFd);
+    if (mEpollFd != INVALID_VALUE)
+        close(mEpollFd);
+    if (mEventFd != INVALID_VALUE)
+        close(mEventFd);
+}
+
+/* Start the thread running the loop, the fds may be added before */
+int EventLoop::start() {
+    if (mEpollFd < 0 || mEventFd < 0)
+        return -1;
+
+    mThread = std::thread(&EventLoop::run, this);
+    return 0;
+}
+
+/* Stop the loop, no handler is called once it returns */
+void EventLoop::stop() {
+    uint64_t value = 1;
+
+    if (!mThread.joinable())
+        return;
+
+    mExit = true;
+    if (write(mEventFd, &value, sizeof(value)) < 0)
+        ALOGE("Failed to wake up event loop, errno = %d", errno);
+    mThread.join();
+}
+
+/** Watch a fd
+ *
+ *  @param fd:      fd to watch, it must stay open until it's removed.
+ *  @param events:  epoll events to watch.
+ *  @param handler: called on the loop thread with the events of the fd.
+ */
+int EventLoop::add(int fd, uint32_t events, std::function<void(uint32_t)> handler) {
+    std::lock_guard<std::mutex> lock(mLock);
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ALOGE("Failed to add fd %d to event loop, errno = %d", fd, errno);
+        return -1;
+    }
+
+    mHandlers[fd] = std::make_shared<std::function<void(uint32_t)>>(std::move(handler));
+    return 0;
+}
+
+/* Change the events watched on an fd already added, keeping its handler */
+int EventLoop::modify(int fd, uint32_t events) {
+    std::lock_guard<std::mutex> lock(mLock);
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        ALOGE("Failed to modify fd %d in event loop, errno = %d", fd, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+void EventLoop::remove(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mHandlers.erase(fd) == 0)
+        return;
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        ALOGE("Failed to remove fd %d from event loop, errno = %d", fd, errno);
+}
+
+/*
+ * Call the handler with each kernel uevent, the uevent socket is opened with
+ * the first handler and shared by all of them.
+ */
+int EventLoop::addUeventHandler(std::function<void(const char *msg, int len)> handler) {
+    int fd;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mUeventHandlers.push_back(std::move(handler));
+        if (mUeventFd != INVALID_VALUE)
+            return 0;
+
+        fd = uevent_open_socket(UEVENT_BUF_SIZE, true);
+        if (fd < 0) {
+            ALOGE("open uevent socket failed: %d", fd);
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        mUeventFd = fd;
+    }
+
+    return add(fd, EPOLLIN, [this](uint32_t) { handleUevents(); });
+}
+
+void EventLoop::handleUevents() {
+    std::vector<std::function<void(const char*, int)>> handlers;
+    char msg[UEVENT_MSG_LEN + 2];
+    int n;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        handlers = mUeventHandlers;
+    }
+
+    while ((n = uevent_kernel_multicast_recv(mUeventFd, msg, UEVENT_MSG_LEN)) > 0) {
+        if (n > UEVENT_MSG_LEN) {
+            ALOGE("Message length %d is not correct\n", n);
+            continue;
+        }
+
+        /* The message is a list of strings ended by an empty one */
+        msg[n] = '\0';
+        msg[n + 1] = '\0';
+        for (auto& handler : handlers)
+            handler(msg, n);
+    }
+}
+
+void EventLoop::run() {
+    struct epoll_event events[EPOLL_EVENT_BATCH];
+    std::shared_ptr<std::function<void(uint32_t)>> handler;
+    int64_t startUs, elapsedUs;
+    uint64_t value;
+    int nfd, i;
+
+    RealtimePolicy::apply("vibrator-loop");
+    while (!mExit) {
+        nfd = epoll_wait(mEpollFd, events, EPOLL_EVENT_BATCH, -1);
+        if (nfd < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("Failed to wait events, errno = %d", errno);
+            return;
+        }
+
+        mWakeups++;
+        for (i = 0; i < nfd && !mExit; i++) {
+            if (events[i].data.fd == mEventFd) {
+                if (read(mEventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    ALOGE("Failed to read eventfd, errno = %d", errno);
+                continue;
+            }
+
+            /* The fd may have been removed by an earlier handler of the batch */
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                auto it = mHandlers.find(events[i].data.fd);
+
+                if (it == mHandlers.end())
+                    continue;
+                handler = it->second;
+            }
+
+            startUs = getMonotonicUs();
+            (*handler)(events[i].events);
+            elapsedUs = getMonotonicUs() - startUs;
+
+            mEvents++;
+            mHandleTotalUs += elapsedUs;
+            if (elapsedUs > mHandleMaxUs)
+                mHandleMaxUs = elapsedUs;
+            handler.reset();
+        }
+    }
+}
+
+void EventLoop::dump(int fd) {
+    int64_t events = mEvents;
+    size_t count;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        count = mHandlers.size();
+    }
+
+    dprintf(fd, "Event loop:\n");
+    dprintf(fd, "  watched fds: %zu, wake-ups: %" PRId64 ", events: %" PRId64 "\n",
+            count, mWakeups.load(), events);
+    dprintf(fd, "  event handling avg %" PRId64 "us, max %" PRId64 "us\n",
+            events ? mHandleTotalUs / events : 0, mHandleMaxUs.load());
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.ext"
+
+#include <log/log.h>
+
+#include "include/VibratorExt.h"
+
+namespace aidl {
+namespace vendor {
+namespace qti {
+namespace hardware {
+namespace vibrator {
+namespace ext {
+
+VibratorExt::VibratorExt(const std::shared_ptr<Vibrator>& vibrator) : mVibrator(vibrator) {}
+
+ndk::ScopedAStatus VibratorExt::prepare(Effect effect, EffectStrength strength) {
+    return mVibrator->prepare(effect, strength);
+}
+
+ndk::ScopedAStatus VibratorExt::trigger(const std::shared_ptr<IVibratorCallback>& callback,
+                                        int32_t* _aidl_return) {
+    return mVibrator->trigger(callback, _aidl_return);
+}
+
+ndk::ScopedAStatus VibratorExt::scheduleEffect(Effect effect, EffectStrength strength,
+                                               int64_t startTimeNs,
+                                               const std::shared_ptr<IVibratorCallback>& callback,
+                                               int32_t* _aidl_return) {
+    return mVibrator->scheduleEffect(effect, strength, startTimeNs, callback, _aidl_return);
+}
+
+ndk::ScopedAStatus VibratorExt::scheduleCompose(const std::vector<CompositeEffect>& composite,
+                                                int64_t startTimeNs,
+                                                const std::shared_ptr<IVibratorCallback>& callback) {
+    return mVibrator->scheduleCompose(composite, startTimeNs, callback);
+}
+
+ndk::ScopedAStatus VibratorExt::cancelScheduled() {
+    return mVibrator->cancelScheduled();
+}
+
+ndk::ScopedAStatus VibratorExt::armTouchRegion(int32_t left, int32_t top, int32_t right,
+                                               int32_t bottom, Effect effect,
+                                               EffectStrength strength) {
+    return mVibrator->armTouchRegion(left, top, right, bottom, effect, strength);
+}
+
+ndk::ScopedAStatus VibratorExt::disarmTouch() {
+    return mVibrator->disarmTouch();
+}
+
+}  // namespace ext
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace qti
+}  // namespace vendor
+}  // namespace aidl
@@ -37,14 +37,13 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <thread>
+#include <time.h>
 #include <linux/input.h>
 #include <log/log.h>
 #include <fcntl.h>
 #include <cutils/log.h>
-#include <cutils/uevent.h>
 #include <cutils/properties.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 
 #include "include/Vibrator.h"
@@ -55,7 +54,6 @@ namespace android {
 namespace hardware {
 namespace vibrator {
 
-#define UEVENT_MSG_LEN              1024
 #define SLATE_EVENT "SLATE_EVENT="
 #define SLATE_EVENT_STRING_LEN      12 //length of SLATE_EVENT
 /*
@@ -65,160 +63,280 @@ namespace vibrator {
  */
 #define SLATE_AFTER_POWER_UP        4
 
-PatternOffload::PatternOffload()
+#define GLINK_MAX_CONN_RETRIES      60
+#define GLINK_RETRY_INTERVAL_MS     1000
+#define GLINK_RESPONSE_TIMEOUT_MS   2000
+
+static int64_t getMonotonicNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+PatternOffload::PatternOffload(EventLoop& loop, TimerQueue& timers)
+    : mLoop(loop), mTimers(timers)
 {
     char prop_str[PROPERTY_VALUE_MAX];
     mEnabled = 0;
+    mState = OFFLOAD_IDLE;
+    mRetries = 0;
+    mTimerId = 0;
+    mChannelFd = -1;
+    mWritten = 0;
 
     if (property_get("ro.vendor.qc_aon_presence", prop_str, NULL))
         mEnabled = atoi(prop_str);
+}
 
+/* Offload the patterns from the event loop now and each time SLATE powers up */
+void PatternOffload::start()
+{
     if (mEnabled != 1)
         return;
 
-    std::thread t(&PatternOffload::SSREventListener, this);
-    t.detach();
+    mLoop.addUeventHandler([this](const char *msg, int len __unused) {
+        SSREvent(msg);
+    });
+
+    /* Offload during the bootup */
+    mTimers.post(0, [this] { SendPatterns(); });
 }
 
-void PatternOffload::SSREventListener(void)
+void PatternOffload::SSREvent(const char *msg)
 {
-    int device_fd, n, ssr_event = 0;
-    char msg[UEVENT_MSG_LEN + 2];
-    char *msg_ptr = msg;
-
-    /* Offload during the bootup */
-    SendPatterns();
+    const char *msg_ptr = msg;
+    int ssr_event = 0;
 
-    device_fd = uevent_open_socket(64*1024, true);
-    if(device_fd < 0)
-    {
-        ALOGE("open socket failed: %d", device_fd);
+    if (!strstr(msg, "slate_com_dev"))
         return;
-    }
 
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-         if (n <= 0 || n > UEVENT_MSG_LEN) {
-            ALOGE("Message length %d is not correct\n", n);
-            continue;
-         }
-         msg[n] = '\0';
-         msg[n+1] = '\0';
-         if (strstr(msg, "slate_com_dev")) {
-             while(*msg_ptr) {
-                 if(!strncmp(msg_ptr, SLATE_EVENT, SLATE_EVENT_STRING_LEN)) {
-                     msg_ptr += SLATE_EVENT_STRING_LEN;
-                     ssr_event = (atoi(msg_ptr));
-                     switch(ssr_event) {
-                         case SLATE_AFTER_POWER_UP:
-                             ALOGD("SLATE is powered up");
-                             SendPatterns();
-                             break;
-                     }
-                 }
-                 while(*msg_ptr++);
-             }
-         }
-     }
+    while(*msg_ptr) {
+        if(!strncmp(msg_ptr, SLATE_EVENT, SLATE_EVENT_STRING_LEN)) {
+            msg_ptr += SLATE_EVENT_STRING_LEN;
+            ssr_event = (atoi(msg_ptr));
+            switch(ssr_event) {
+                case SLATE_AFTER_POWER_UP:
+                    ALOGD("SLATE is powered up");
+                    SendPatterns();
+                    break;
+            }
+        }
+        while(*msg_ptr++);
+    }
 }
 
 /** Offload patterns
- *  The sequence of steps in offloading patterns.
- *  1. Open the Glink channel to offload the patterns
+ *  The sequence of steps in offloading patterns, each step runs on the event
+ *  loop so nothing blocks while the co-proc answers or while the channel is
+ *  full.
+ *  1. Open the Glink channel to offload the patterns, retried every second
+ *     while the channel isn't up
  *  2. Send the configuration/meta data to co-proc
  *  3. Wait for the response from the co-proc
  *  4. Send the pattern data to co-proc
  *  5. Wait for the response
- *  6. Exit
+ *  6. Close the channel
  */
 void PatternOffload::SendPatterns()
+{
+    /* Start over if SLATE restarted in the middle of an offload */
+    closeChannel();
+    mRetries = 0;
+    tryOffload();
+}
+
+void PatternOffload::tryOffload()
 {
     uint8_t *data;
     uint32_t len;
     int32_t rc;
 
+    mTimerId = 0;
     rc = initChannel();
     if (rc < 0)
         return;
 
     rc = get_pattern_config(&data, &len);
     if (rc < 0 || !data)
-        return;
+        goto err;
 
     /* Send config data */
     rc = sendData(data, len);
     if (rc < 0)
+        goto err;
+
+    mState = OFFLOAD_CONFIG;
+    return;
+
+err:
+    ALOGE("pattern offloaded failed\n");
+    closeChannel();
+}
+
+void PatternOffload::onChannelEvents(uint32_t events)
+{
+    if ((events & EPOLLOUT) && flushData() < 0) {
+        ALOGE("pattern offloaded failed\n");
+        closeChannel();
+        return;
+    }
+
+    if ((events & EPOLLIN) && mChannelFd >= 0)
+        onResponse();
+}
+
+/* Handle the response of the co-proc to the data sent last */
+void PatternOffload::onResponse()
+{
+    uint8_t *data;
+    uint32_t len;
+    int rc, status = 0;
+
+    rc = GlinkCh.GlinkRead((uint8_t *)&status, 4);
+    if (rc == -EAGAIN)
         return;
 
-    rc = get_pattern_data(&data, &len);
-    if (rc < 0)
+    mTimers.cancel(mTimerId);
+    mTimerId = 0;
+    if (rc < 0 || status != OFFLOAD_SUCCESS)
+        goto err;
+
+    if (mState == OFFLOAD_CONFIG) {
+        rc = get_pattern_data(&data, &len);
+        if (rc < 0)
+            goto err;
+
+        /* Send pattern data */
+        rc = sendData(data, len);
+        free_pattern_mem(data);
+        if (rc < 0)
+            goto err;
+
+        mState = OFFLOAD_DATA;
         return;
+    }
 
-    /* Send pattern data */
-    rc = sendData(data, len);
-    if (rc < 0)
-        ALOGE("pattern offloaded failed\n");
-    else
-        ALOGI("Patterns offloaded successfully\n");
+    ALOGI("Patterns offloaded successfully\n");
+    closeChannel();
+    return;
 
-    free_pattern_mem(data);
+err:
+    ALOGE("pattern offloaded failed\n");
+    closeChannel();
 }
 
+/*
+ * Write the data and wait for the response of the co-proc. The data is copied
+ * as the write may complete later from the event loop, and the timeout covers
+ * both the write and the response.
+ */
 int PatternOffload::sendData(uint8_t *data, int len)
 {
-    int rc, status = 0;
+    int rc;
 
     if (!data || !len)
         return -EINVAL;
 
-    rc = GlinkCh.GlinkWrite(data, len);
+    mWriteBuf.assign(data, data + len);
+    mWritten = 0;
+    rc = flushData();
     if (rc < 0)
         return rc;
 
-    rc = GlinkCh.GlinkPoll();
-    if (rc < 0)
-        return rc;
+    mTimerId = mTimers.post(getMonotonicNs() + GLINK_RESPONSE_TIMEOUT_MS * 1000000LL, [this] {
+        mTimerId = 0;
+        ALOGE("Glink response timeout");
+        closeChannel();
+    });
 
-    rc = GlinkCh.GlinkRead((uint8_t *)&status, 4);
+    return 0;
+}
+
+/* Write what the channel takes of the pending data, and watch EPOLLOUT for the rest */
+int PatternOffload::flushData()
+{
+    size_t written = 0;
+    int rc;
+
+    if (mWritten == mWriteBuf.size())
+        return 0;
+
+    rc = GlinkCh.GlinkWrite(mWriteBuf.data() + mWritten, mWriteBuf.size() - mWritten, &written);
+    mWritten += written;
+    if (rc == -EAGAIN)
+        return mLoop.modify(mChannelFd, EPOLLIN | EPOLLOUT);
     if (rc < 0)
         return rc;
 
-    if (status != OFFLOAD_SUCCESS)
-        return -EIO;
-
-    return 0;
+    mWriteBuf.clear();
+    mWritten = 0;
+    return mLoop.modify(mChannelFd, EPOLLIN);
 }
 
-
 int PatternOffload::initChannel()
 {
     std::string chname = "/dev/glinkpkt_slate_haptics_offload";
     int rc;
 
     rc = GlinkCh.GlinkOpen(chname);
+    if (rc == -ETIMEDOUT && ++mRetries < GLINK_MAX_CONN_RETRIES) {
+        /* The channel isn't up yet, try again later without blocking the loop */
+        mTimerId = mTimers.post(getMonotonicNs() + GLINK_RETRY_INTERVAL_MS * 1000000LL,
+                                [this] { tryOffload(); });
+        return rc;
+    }
+
     if (rc < 0)
     {
         ALOGE("Failed to open Glink channel name %s\n", chname.c_str());
         return rc;
     }
 
+    if (mLoop.add(rc, EPOLLIN, [this](uint32_t events) { onChannelEvents(events); }) != 0) {
+        GlinkCh.GlinkClose();
+        return -1;
+    }
+
+    mChannelFd = rc;
     return 0;
 }
 
-#define GLINK_MAX_CONN_RETRIES    60
+void PatternOffload::closeChannel()
+{
+    if (mTimerId != 0)
+        mTimers.cancel(mTimerId);
+    mTimerId = 0;
+
+    if (mChannelFd >= 0) {
+        mLoop.remove(mChannelFd);
+        GlinkCh.GlinkClose();
+        mChannelFd = -1;
+    }
+
+    mWriteBuf.clear();
+    mWritten = 0;
+    mState = OFFLOAD_IDLE;
+}
+
+OffloadGlinkConnection::OffloadGlinkConnection()
+{
+    fd = -1;
+}
+
+/* Open the channel without blocking, return the fd or -errno */
 int OffloadGlinkConnection::GlinkOpen(std::string& dev)
 {
-    int tries = GLINK_MAX_CONN_RETRIES;
-    dev_name = dev;
+    int err;
 
-    do {
-        fd = ::open(dev_name.c_str(), O_RDWR);
-        tries--;
-        if (fd < 0)
-        {
-            ALOGE("%s: %s: open error(%s)", __func__, dev.c_str(), strerror(errno));
-            sleep(1);
-        }
-    } while(-ETIMEDOUT == errno && tries > 0 );
+    dev_name = dev;
+    fd = ::open(dev_name.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err = errno;
+        ALOGE("%s: %s: open error(%s)", __func__, dev.c_str(), strerror(err));
+        return -err;
+    }
 
     return fd;
 }
@@ -233,67 +351,42 @@ int OffloadGlinkConnection::GlinkClose()
     return 0;
 }
 
-int OffloadGlinkConnection::GlinkPoll()
-{
-    ssize_t rc = 0;
-    struct pollfd poll_fd;
-
-    // wait for Rx data available in fd, for 2 seconds timeout
-    poll_fd.fd = fd;
-    poll_fd.events = POLLIN;
-
-    rc = ::poll(&poll_fd, 1, 2000);
-
-    if(rc > 0)
-    {
-        if (poll_fd.revents & POLLIN)
-            return 0;
-    } else if (rc == 0) {
-           ALOGE("Glink poll timeout");
-    } else {
-           ALOGE("Glink poll error: %s\n", strerror(errno));
-    }
-
-    return -1;
-}
-
+/* Read a whole packet, return -EAGAIN if none is available yet */
 int OffloadGlinkConnection::GlinkRead(uint8_t *data, size_t size)
 {
     int rc = 0;
-    size_t bytes_read = 0;
 
     if (fd < 0)
         return -1;
 
-    if (0 != GlinkPoll())
+    rc = ::read(fd, data, size);
+    if (rc < 0) {
+        if (errno == EAGAIN)
+            return -EAGAIN;
+        ALOGE("%s: Read error: %s, rc %d", __func__, strerror(errno), rc);
+        return -1;
+    } else if (rc == 0) {
+        ALOGE("%s: Zero length packet received or hardware connection went off",
+                __func__);
+        return -1;
+    } else if ((size_t)rc < size) {
+        ALOGE("%s: Short packet of %d bytes received", __func__, rc);
         return -1;
-
-    while (bytes_read < size)
-    {
-        rc = ::read(fd, data+bytes_read, size-bytes_read);
-        if (rc < 0) {
-            if (errno != EAGAIN) {
-                ALOGE("%s: Read error: %s, rc %d", __func__,
-                                strerror(errno), rc);
-                goto read_error;
-            }
-        } else if (rc == 0) {
-            ALOGE("%s: Zero length packet received or hardware connection went off",
-                    __func__);
-        }
-        bytes_read += rc;
     }
-    return 0;
 
-read_error:
-    return -1;
+    return 0;
 }
 
-int OffloadGlinkConnection::GlinkWrite(uint8_t *buf, size_t buflen)
+/*
+ * Write as much of the buffer as the channel takes, return -EAGAIN once it's
+ * full, with the number of bytes written so far in written.
+ */
+int OffloadGlinkConnection::GlinkWrite(uint8_t *buf, size_t buflen, size_t *written)
 {
     size_t bytes_written_out = 0;
     int rc = 0;
 
+    *written = 0;
     if (fd < 0)
         return -1;
 
@@ -305,14 +398,16 @@ int OffloadGlinkConnection::GlinkWrite(uint8_t *buf, size_t buflen)
     while (bytes_written_out < buflen) {
         rc = ::write (fd, buf+bytes_written_out, buflen-bytes_written_out);
         if (rc < 0) {
+            if (errno == EAGAIN)
+                break;
             ALOGE("%s: Write returned failure %d", __func__, rc);
-            return errno;
+            return -1;
         }
         bytes_written_out += rc;
     }
-    rc = 0;
 
-    return rc;
+    *written = bytes_written_out;
+    return bytes_written_out < buflen ? -EAGAIN : 0;
 }
 
 }  // namespace vibrator
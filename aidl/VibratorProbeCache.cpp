@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.probecache"
+
+#include <cutils/properties.h>
+#include <fcntl.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+#define INVALID_VALUE           -1
+#define PROBE_CACHE_VERSION     1
+#define LINE_BUF_SIZE           1024
+
+static const char PROBE_CACHE_FILE[] = "/data/vendor/vibrator/probe_cache";
+static const char PROBE_CACHE_TMP_FILE[] = "/data/vendor/vibrator/probe_cache.tmp";
+
+/* Read a one line attribute of the input device behind an event node */
+static int readInputAttribute(const std::string& node, const char *attr, char *buf, size_t len) {
+    char path[PATH_MAX];
+    size_t pos = node.rfind('/');
+    FILE *fp;
+
+    if (pos == std::string::npos)
+        return -EINVAL;
+
+    snprintf(path, sizeof(path), "/sys/class/input/%s/%s", node.c_str() + pos + 1, attr);
+    fp = fopen(path, "re");
+    if (fp == NULL)
+        return -errno;
+
+    if (fgets(buf, len, fp) == NULL) {
+        fclose(fp);
+        return -EIO;
+    }
+
+    fclose(fp);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/** Load the probe result of the previous boot
+ *
+ *  The cache is only used if it was written by the same version of the HAL
+ *  on the same build, and if the event node it names still belongs to the same
+ *  device, checked with its name and its device number in sysfs.
+ */
+int ProbeCache::load(Entry *entry) {
+    char line[LINE_BUF_SIZE];
+    char prop[PROPERTY_VALUE_MAX];
+    char buf[LINE_BUF_SIZE];
+    std::string build, dev;
+    int version = INVALID_VALUE, value, n, i;
+    char *p;
+    FILE *fp;
+
+    fp = fopen(PROBE_CACHE_FILE, "re");
+    if (fp == NULL)
+        return -errno;
+
+    memset(entry->ffBitmask, 0, sizeof(entry->ffBitmask));
+    entry->supportStatus = false;
+    entry->slots = 0;
+    entry->supportExternalControl = false;
+    entry->hasDurations = false;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        p = strchr(line, ' ');
+        if (p == NULL)
+            continue;
+        *p++ = '\0';
+
+        if (!strcmp(line, "version")) {
+            version = atoi(p);
+        } else if (!strcmp(line, "build")) {
+            build = p;
+        } else if (!strcmp(line, "node")) {
+            entry->node = p;
+        } else if (!strcmp(line, "name")) {
+            entry->name = p;
+        } else if (!strcmp(line, "dev")) {
+            dev = p;
+        } else if (!strcmp(line, "ff")) {
+            for (i = 0; i < (int)sizeof(entry->ffBitmask); i++) {
+                if (sscanf(p, "%2x%n", &value, &n) != 1)
+                    break;
+                entry->ffBitmask[i] = value;
+                p += n;
+            }
+            if (i != (int)sizeof(entry->ffBitmask))
+                version = INVALID_VALUE;
+        } else if (!strcmp(line, "status")) {
+            entry->supportStatus = atoi(p) != 0;
+        } else if (!strcmp(line, "slots")) {
+            entry->slots = atoi(p);
+        } else if (!strcmp(line, "external")) {
+            entry->supportExternalControl = atoi(p) != 0;
+        } else if (!strcmp(line, "durations")) {
+            for (i = 0; i < (int)entry->primitiveDurationMs.size(); i++) {
+                if (sscanf(p, "%d%n", &entry->primitiveDurationMs[i], &n) != 1)
+                    break;
+                p += n;
+            }
+            entry->hasDurations = i == (int)entry->primitiveDurationMs.size();
+        }
+    }
+    fclose(fp);
+
+    property_get("ro.vendor.build.fingerprint", prop, "");
+    if (version != PROBE_CACHE_VERSION || build != prop || entry->node.empty() ||
+            entry->slots <= 0) {
+        ALOGI("probe cache is outdated");
+        return -EINVAL;
+    }
+
+    if (readInputAttribute(entry->node, "device/name", buf, sizeof(buf)) < 0 ||
+            entry->name != buf) {
+        ALOGI("%s is no longer %s", entry->node.c_str(), entry->name.c_str());
+        return -ENODEV;
+    }
+
+    if (readInputAttribute(entry->node, "dev", buf, sizeof(buf)) < 0 || dev != buf) {
+        ALOGI("%s is no longer the cached device", entry->node.c_str());
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+/* Save the probe result, the file is replaced as a whole so a partial write is never loaded */
+int ProbeCache::save(const Entry& entry) {
+    char prop[PROPERTY_VALUE_MAX];
+    char dev[PROPERTY_VALUE_MAX];
+    FILE *fp;
+    size_t i;
+
+    if (readInputAttribute(entry.node, "dev", dev, sizeof(dev)) < 0)
+        return -ENODEV;
+
+    fp = fopen(PROBE_CACHE_TMP_FILE, "we");
+    if (fp == NULL) {
+        ALOGE("open %s failed, errno = %d", PROBE_CACHE_TMP_FILE, errno);
+        return -errno;
+    }
+
+    property_get("ro.vendor.build.fingerprint", prop, "");
+    fprintf(fp, "version %d\n", PROBE_CACHE_VERSION);
+    fprintf(fp, "build %s\n", prop);
+    fprintf(fp, "node %s\n", entry.node.c_str());
+    fprintf(fp, "name %s\n", entry.name.c_str());
+    fprintf(fp, "dev %s\n", dev);
+    fprintf(fp, "ff ");
+    for (i = 0; i < sizeof(entry.ffBitmask); i++)
+        fprintf(fp, "%02x", entry.ffBitmask[i]);
+    fprintf(fp, "\nstatus %d\n", entry.supportStatus);
+    fprintf(fp, "slots %d\n", entry.slots);
+    fprintf(fp, "external %d\n", entry.supportExternalControl);
+    if (entry.hasDurations) {
+        fprintf(fp, "durations");
+        for (auto d : entry.primitiveDurationMs)
+            fprintf(fp, " %d", d);
+        fprintf(fp, "\n");
+    }
+
+    if (fclose(fp) != 0 || rename(PROBE_CACHE_TMP_FILE, PROBE_CACHE_FILE) != 0) {
+        ALOGE("write %s failed, errno = %d", PROBE_CACHE_FILE, errno);
+        unlink(PROBE_CACHE_TMP_FILE);
+        return -errno;
+    }
+
+    ALOGI("probe result of %s is cached", entry.node.c_str());
+    return 0;
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.realtime"
+
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+static int sPriority;
+static unsigned long sCpuMask;
+static bool sMemoryLocked;
+static std::atomic<int> sRealtimeThreads;
+static std::atomic<int> sRealtimeFailures;
+
+/*
+ * Read the policy from the vendor properties, all of them are unset by default
+ * so that the threads keep the default CFS policy:
+ *  ro.vendor.qti.vibrator.rt_priority:  SCHED_FIFO priority, 0 to disable.
+ *  ro.vendor.qti.vibrator.cpu_affinity: mask of the CPUs to run on, 0 for all.
+ *  ro.vendor.qti.vibrator.mlockall:     lock the HAL memory to avoid page faults.
+ */
+void RealtimePolicy::init() {
+    char prop_str[PROPERTY_VALUE_MAX];
+
+    sPriority = property_get_int32("ro.vendor.qti.vibrator.rt_priority", 0);
+    if (sPriority < 0 || sPriority > sched_get_priority_max(SCHED_FIFO)) {
+        ALOGE("Invalid SCHED_FIFO priority %d", sPriority);
+        sPriority = 0;
+    }
+
+    if (property_get("ro.vendor.qti.vibrator.cpu_affinity", prop_str, NULL))
+        sCpuMask = strtoul(prop_str, NULL, 0);
+
+    if (property_get_bool("ro.vendor.qti.vibrator.mlockall", false)) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+            sMemoryLocked = true;
+        else
+            ALOGE("Failed to lock memory, errno = %d", errno);
+    }
+}
+
+/* Apply the policy to the calling thread, it keeps running with the default one on failure */
+void RealtimePolicy::apply(const char *name) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int ret, cpu;
+
+    pthread_setname_np(pthread_self(), name);
+
+    if (sCpuMask != 0) {
+        CPU_ZERO(&cpus);
+        for (cpu = 0; cpu < CPU_SETSIZE && cpu < (int)sizeof(sCpuMask) * 8; cpu++) {
+            if (sCpuMask & (1UL << cpu))
+                CPU_SET(cpu, &cpus);
+        }
+
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+            ALOGE("Failed to set %s affinity to 0x%lx, errno = %d", name, sCpuMask, errno);
+    }
+
+    if (sPriority == 0)
+        return;
+
+    param.sched_priority = sPriority;
+    ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+        ALOGE("Failed to set %s to SCHED_FIFO %d, error = %d", name, sPriority, ret);
+        sRealtimeFailures++;
+        return;
+    }
+
+    sRealtimeThreads++;
+}
+
+void RealtimePolicy::dump(int fd) {
+    dprintf(fd, "Real-time policy:\n");
+    dprintf(fd, "  SCHED_FIFO priority: %d, cpu mask: 0x%lx, memory locked: %s\n",
+            sPriority, sCpuMask, sMemoryLocked ? "yes" : "no");
+    dprintf(fd, "  real-time threads: %d, failed: %d\n",
+            sRealtimeThreads.load(), sRealtimeFailures.load());
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.scheduler"
+
+#include <inttypes.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+#define INVALID_VALUE           -1
+
+static int64_t getMonotonicNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+TimerQueue::TimerQueue(EventLoop& loop) : mLoop(loop) {
+    mNextId = 1;
+    mTimerFd = INVALID_VALUE;
+    mFired = 0;
+    mCancelled = 0;
+    mLateTotalNs = 0;
+    mLateMaxNs = 0;
+}
+
+TimerQueue::~TimerQueue() {
+    if (mTimerFd != INVALID_VALUE) {
+        mLoop.remove(mTimerFd);
+        close(mTimerFd);
+    }
+}
+
+/* Create the timerfd and watch it from the event loop, called with mLock held */
+int TimerQueue::init() {
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (mTimerFd < 0) {
+        ALOGE("Failed to create timerfd, errno = %d", errno);
+        return -1;
+    }
+
+    if (mLoop.add(mTimerFd, EPOLLIN, [this](uint32_t) { expire(); }) != 0) {
+        close(mTimerFd);
+        mTimerFd = INVALID_VALUE;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Arm the timerfd for the earliest timer, called with mLock held */
+void TimerQueue::arm() {
+    struct itimerspec its;
+    int64_t deadlineNs = 0;
+
+    /* Drop the cancelled timers from the top of the heap */
+    while (!mHeap.empty() && mTasks.find(mHeap.top().id) == mTasks.end())
+        mHeap.pop();
+
+    memset(&its, 0, sizeof(its));
+    if (!mHeap.empty()) {
+        /* A zero it_value disarms the timer */
+        deadlineNs = mHeap.top().deadlineNs > 0 ? mHeap.top().deadlineNs : 1;
+        its.it_value.tv_sec = deadlineNs / 1000000000LL;
+        its.it_value.tv_nsec = deadlineNs % 1000000000LL;
+    }
+
+    if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        ALOGE("Failed to arm timerfd, errno = %d", errno);
+}
+
+/** Post a task
+ *
+ *  @param deadlineNs: absolute CLOCK_MONOTONIC time to run the task at, a time
+ *                     in the past runs the task immediately.
+ *  @param task:       task to be run on the timer thread. Tasks with the same
+ *                     deadline are run in the order they are posted.
+ *
+ *  @return id of the timer to cancel the task, 0 on failure.
+ */
+uint64_t TimerQueue::post(int64_t deadlineNs, std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mLock);
+    uint64_t id;
+
+    if (mTimerFd == INVALID_VALUE && init() != 0)
+        return 0;
+
+    id = mNextId++;
+    mTasks[id] = std::move(task);
+    mHeap.push({deadlineNs, id});
+    if (mHeap.top().id == id)
+        arm();
+
+    return id;
+}
+
+/* Cancel a task, return false if it has already run or been cancelled */
+bool TimerQueue::cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mTasks.erase(id) == 0)
+        return false;
+
+    mCancelled++;
+    arm();
+    return true;
+}
+
+/* Run the tasks which are due, called on the event loop thread */
+void TimerQueue::expire() {
+    std::vector<std::pair<int64_t, std::function<void()>>> due;
+    uint64_t value;
+    int64_t now, late;
+
+    if (read(mTimerFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        ALOGE("Failed to read timerfd, errno = %d", errno);
+
+    now = getMonotonicNs();
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        while (!mHeap.empty() && mHeap.top().deadlineNs <= now) {
+            auto it = mTasks.find(mHeap.top().id);
+
+            if (it != mTasks.end()) {
+                due.emplace_back(mHeap.top().deadlineNs, std::move(it->second));
+                mTasks.erase(it);
+            }
+            mHeap.pop();
+        }
+        arm();
+    }
+
+    for (auto& task : due) {
+        late = now - task.first;
+        mFired++;
+        mLateTotalNs += late;
+        if (late > mLateMaxNs)
+            mLateMaxNs = late;
+        task.second();
+    }
+}
+
+void TimerQueue::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    dprintf(fd, "Timer queue:\n");
+    dprintf(fd, "  pending: %zu, fired: %" PRId64 ", cancelled: %" PRId64 "\n",
+            mTasks.size(), mFired.load(), mCancelled);
+    dprintf(fd, "  scheduling error avg %" PRId64 "ns, max %" PRId64 "ns\n",
+            mFired ? mLateTotalNs / mFired : 0, mLateMaxNs.load());
+}
+
+PlaybackScheduler::PlaybackScheduler(TimerQueue& timers) : mTimers(timers) {
+    mTimerId = 0;
+    mGeneration = 0;
+    mStarts = 0;
+    mStartErrorTotalNs = 0;
+    mStartErrorMaxNs = 0;
+}
+
+/** Schedule a playback
+ *
+ *  @param startTimeNs: absolute CLOCK_MONOTONIC time to start the playback at,
+ *                      a time already past starts it right away.
+ *  @param task:        task starting the playback, it replaces the pending one.
+ *  @param release:     called instead of the task if it's replaced or cancelled,
+ *                      e.g. to drop the slot reserved for it.
+ */
+int PlaybackScheduler::schedule(int64_t startTimeNs, std::function<void()> task,
+                                std::function<void()> release) {
+    std::function<void()> replaced;
+    int ret;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        uint64_t generation = ++mGeneration;
+
+        if (mTimerId != 0) {
+            mTimers.cancel(mTimerId);
+            replaced = std::move(mRelease);
+        }
+        mRelease = std::move(release);
+
+        mTimerId = mTimers.post(startTimeNs, [this, generation, task = std::move(task)] {
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+
+                /* Replaced or cancelled while it was due */
+                if (generation != mGeneration)
+                    return;
+                mTimerId = 0;
+                mRelease = nullptr;
+            }
+
+            task();
+        });
+        ret = mTimerId != 0 ? 0 : -1;
+    }
+
+    if (replaced)
+        replaced();
+    return ret;
+}
+
+/*
+ * Called by the task once the play write of the scheduled playback returned,
+ * so the start error covers the timer and the playback latencies.
+ */
+void PlaybackScheduler::recordStart(int64_t startTimeNs) {
+    int64_t error = getMonotonicNs() - startTimeNs;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mStarts++;
+    mStartErrorTotalNs += error;
+    if (error > mStartErrorMaxNs)
+        mStartErrorMaxNs = error;
+
+    ALOGD("Scheduled playback started %" PRId64 "ns late", error);
+}
+
+void PlaybackScheduler::cancel() {
+    std::function<void()> cancelled;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mGeneration++;
+        if (mTimerId != 0) {
+            mTimers.cancel(mTimerId);
+            cancelled = std::move(mRelease);
+        }
+        mTimerId = 0;
+        mRelease = nullptr;
+    }
+
+    if (cancelled)
+        cancelled();
+}
+
+void PlaybackScheduler::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    dprintf(fd, "Scheduled playback:\n");
+    dprintf(fd, "  pending: %s, started: %" PRId64 "\n", mTimerId ? "yes" : "no", mStarts);
+    dprintf(fd, "  start error avg %" PRId64 "ns, max %" PRId64 "ns\n",
+            mStarts ? mStartErrorTotalNs / mStarts : 0, mStartErrorMaxNs);
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#define LOG_TAG "vendor.qti.vibrator.touch"
+
+#include <cutils/properties.h>
+#include <inttypes.h>
+#include <linux/input.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+#include "include/Vibrator.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace vibrator {
+
+#define INVALID_VALUE           -1
+#define TOUCH_EVENT_BATCH       64
+
+static const char TOUCH_DEVICES_PROP[] = "ro.vendor.qti.vibrator.touch_devices";
+
+/* Upper bounds of the touch-to-play latency histogram buckets, the last one is unbounded */
+static const int64_t LatencyBucketsUs[TouchTrigger::LATENCY_BUCKETS - 1] = {
+    500, 1000, 2000, 4000, 8000,
+};
+
+TouchTrigger::TouchTrigger(EventLoop& loop) : mLoop(loop) {
+    char prop[PROPERTY_VALUE_MAX];
+
+    mArmed = false;
+    mLeft = mTop = mRight = mBottom = 0;
+    mEffect = Effect::CLICK;
+    mStrength = EffectStrength::MEDIUM;
+    mFired = 0;
+    for (auto& bucket : mLatency)
+        bucket = 0;
+
+    mEnabled = property_get(TOUCH_DEVICES_PROP, prop, "") > 0;
+}
+
+TouchTrigger::~TouchTrigger() {
+    for (auto& dev : mDevices) {
+        mLoop.remove(dev->fd);
+        close(dev->fd);
+    }
+}
+
+/** Open the touchscreens listed in ro.vendor.qti.vibrator.touch_devices
+ *
+ *  The property holds a comma separated list of input device names. The names
+ *  are matched through sysfs so only the listed devices are opened. Their
+ *  events are timestamped with CLOCK_MONOTONIC so the latency from the touch
+ *  to the play write can be measured.
+ */
+int TouchTrigger::openDevices() {
+    char names[PROPERTY_VALUE_MAX + 2];
+    char devicename[PATH_MAX];
+    std::vector<std::string> nodes;
+    int clockId = CLOCK_MONOTONIC;
+    std::shared_ptr<TouchDevice> dev;
+    std::string name;
+    int fd;
+
+    /* Surround the list with commas to match whole names */
+    names[0] = ',';
+    property_get(TOUCH_DEVICES_PROP, names + 1, "");
+    strlcat(names, ",", sizeof(names));
+
+    if (scanInputDevices([&](const char *node, const char *devName) {
+        name = std::string(",") + devName + ",";
+        if (strstr(names, name.c_str()) != NULL)
+            nodes.push_back(node);
+        return false;
+    }) < 0)
+        return -1;
+
+    for (auto& node : nodes) {
+        snprintf(devicename, PATH_MAX, "/dev/input/%s", node.c_str());
+        fd = TEMP_FAILURE_RETRY(open(devicename, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+        if (fd < 0) {
+            ALOGE("open %s failed, errno = %d", devicename, errno);
+            continue;
+        }
+
+        if (TEMP_FAILURE_RETRY(ioctl(fd, EVIOCSCLOCKID, &clockId)) < 0)
+            ALOGE("set clock of %s failed, errno = %d", devicename, errno);
+
+        dev = std::make_shared<TouchDevice>();
+        dev->fd = fd;
+        dev->x = dev->y = 0;
+        dev->down = false;
+        if (mLoop.add(fd, EPOLLIN, [this, dev](uint32_t events) { handleEvents(dev, events); }) != 0) {
+            close(fd);
+            continue;
+        }
+
+        ALOGI("touch trigger listens to %s", devicename);
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            mDevices.push_back(dev);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mDevices.empty() ? -1 : 0;
+}
+
+int TouchTrigger::start(std::function<void(Effect, EffectStrength)> fire) {
+    if (!mEnabled)
+        return 0;
+
+    mFire = std::move(fire);
+    if (openDevices() != 0) {
+        ALOGE("No touch device is found for touch trigger");
+        mEnabled = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Arm the region of the touchscreen, in raw evdev coordinates, with the effect it fires */
+void TouchTrigger::arm(int32_t left, int32_t top, int32_t right, int32_t bottom,
+                       Effect effect, EffectStrength strength) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mLeft = left;
+    mTop = top;
+    mRight = right;
+    mBottom = bottom;
+    mEffect = effect;
+    mStrength = strength;
+    mArmed = true;
+}
+
+void TouchTrigger::disarm() {
+    mArmed = false;
+}
+
+/* Check the position against the armed region, and get the effect armed with it */
+bool TouchTrigger::inRegion(int32_t x, int32_t y, Effect *effect, EffectStrength *strength) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    *effect = mEffect;
+    *strength = mStrength;
+    return x >= mLeft && x <= mRight && y >= mTop && y <= mBottom;
+}
+
+void TouchTrigger::recordLatency(const struct input_event& ie) {
+    struct timespec ts;
+    int64_t latencyUs;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    latencyUs = (ts.tv_sec - ie.time.tv_sec) * 1000000LL +
+            ts.tv_nsec / 1000 - ie.time.tv_usec;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        if (latencyUs < LatencyBucketsUs[i])
+            break;
+    }
+    mLatency[i]++;
+    mFired++;
+}
+
+/* Stop listening to a touchscreen which is gone, called on the event loop thread */
+void TouchTrigger::dropDevice(const std::shared_ptr<TouchDevice>& dev) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    ALOGE("touch device %d is gone, errno = %d", dev->fd, errno);
+    mLoop.remove(dev->fd);
+    close(dev->fd);
+    for (auto it = mDevices.begin(); it != mDevices.end(); it++) {
+        if (*it == dev) {
+            mDevices.erase(it);
+            break;
+        }
+    }
+}
+
+/*
+ * Track the position and BTN_TOUCH of the device, and fire the effect at the
+ * SYN_REPORT of a touch down inside the armed region. Called on the event loop
+ * thread. A removed device keeps reporting EPOLLHUP and fails the reads with
+ * ENODEV, so it's dropped.
+ */
+void TouchTrigger::handleEvents(const std::shared_ptr<TouchDevice>& devp, uint32_t pollEvents) {
+    TouchDevice& dev = *devp;
+    struct input_event events[TOUCH_EVENT_BATCH];
+    EffectStrength strength;
+    Effect effect;
+    ssize_t len;
+    size_t i, count;
+
+    while ((len = read(dev.fd, events, sizeof(events))) > 0) {
+        count = len / sizeof(events[0]);
+        for (i = 0; i < count; i++) {
+            const struct input_event& ie = events[i];
+
+            switch (ie.type) {
+            case EV_ABS:
+                if (ie.code == ABS_MT_POSITION_X || ie.code == ABS_X)
+                    dev.x = ie.value;
+                else if (ie.code == ABS_MT_POSITION_Y || ie.code == ABS_Y)
+                    dev.y = ie.value;
+                break;
+            case EV_KEY:
+                if (ie.code == BTN_TOUCH && ie.value == 1)
+                    dev.down = true;
+                break;
+            case EV_SYN:
+                if (ie.code != SYN_REPORT || !dev.down)
+                    break;
+                dev.down = false;
+                if (mArmed && inRegion(dev.x, dev.y, &effect, &strength)) {
+                    mFire(effect, strength);
+                    recordLatency(ie);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    if ((len < 0 && errno != EAGAIN) || (pollEvents & (EPOLLHUP | EPOLLERR)))
+        dropDevice(devp);
+}
+
+void TouchTrigger::dump(int fd) {
+    size_t devices;
+    int i;
+
+    dprintf(fd, "Touch trigger:\n");
+    if (!mEnabled) {
+        dprintf(fd, "  disabled\n");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        devices = mDevices.size();
+    }
+
+    dprintf(fd, "  devices: %zu, armed: %s, fired: %" PRId64 "\n",
+            devices, mArmed ? "yes" : "no", mFired.load());
+    dprintf(fd, "  touch-to-play latency:");
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+        dprintf(fd, " <%" PRId64 "us: %" PRId64, LatencyBucketsUs[i], mLatency[i].load());
+    dprintf(fd, " >=%" PRId64 "us: %" PRId64 "\n", LatencyBucketsUs[i - 1], mLatency[i].load());
+}
+
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -34,50 +34,181 @@
 #pragma once
 
 #include <aidl/android/hardware/vibrator/BnVibrator.h>
+#ifdef USE_EFFECT_STREAM
+#include "effect.h"
+#endif
+#include <linux/input.h>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace aidl {
 namespace android {
 namespace hardware {
 namespace vibrator {
 
+/*
+ * Walk the input event nodes through sysfs, calling match with the node name,
+ * e.g. "event3", and the input device name until it returns true. No device
+ * node is opened.
+ */
+int scanInputDevices(std::function<bool(const char *node, const char *name)> match);
+
+/*
+ * Probe result of the haptics device persisted across boots, so that a warm
+ * boot only checks the device is still the same instead of scanning for it.
+ */
+class ProbeCache {
+public:
+    struct Entry {
+        std::string node;
+        std::string name;
+        uint8_t ffBitmask[FF_CNT / 8];
+        bool supportStatus;
+        int slots;
+        bool supportExternalControl;
+        std::array<int32_t, 64> primitiveDurationMs;
+        bool hasDurations;
+    };
+
+    static int load(Entry *entry);
+    static int save(const Entry& entry);
+};
+
 class InputFFDevice {
 public:
     InputFFDevice();
     int playEffect(int effectId, EffectStrength es, long *playLengthMs);
+    /* Users of the slot reservations, each one only replaces or clears its own */
+    enum ReserveOwner {
+        RESERVE_PREPARE,
+        RESERVE_SCHEDULE,
+        RESERVE_TOUCH,
+        RESERVE_OWNERS,
+    };
+
+    int prepareEffect(int effectId, EffectStrength es, ReserveOwner owner, int64_t expireNs,
+                      long *playLengthMs);
+    void clearReservation(ReserveOwner owner);
+    int statusFd();
+    int16_t playingId();
     int playPrimitive(int primitiveId, float amplitude, long *playLengthMs);
+    int preparePrimitive(int primitiveId, float amplitude);
+#ifdef USE_EFFECT_STREAM
+    int playStream(const struct effect_stream *stream, long *playLengthMs);
+#endif
     int on(int32_t timeoutMs);
     int off();
     int setAmplitude(uint8_t amplitude);
-    bool mSupportGain;
-    bool mSupportEffects;
-    bool mSupportExternalControl;
-    bool mInExternalControl;
+    void warmUp(const std::vector<int>& effectIds);
+    bool isPresent();
+    void markGone();
+    int rediscover();
+    bool cachedDurations(std::array<int32_t, 64> *durations);
+    void saveProbe(const std::array<int32_t, 64>& durations);
+    void dump(int fd);
+    /* Atomic as rediscover() changes them while the binder threads read them */
+    std::atomic<bool> mSupportGain;
+    std::atomic<bool> mSupportEffects;
+    std::atomic<bool> mSupportExternalControl;
+    std::atomic<bool> mSupportStatus;
+    std::atomic<bool> mInExternalControl;
 
 private:
-    int play(int effectId, uint32_t timeoutMs, long *playLengthMs);
-    int mVibraFd;
+    /*
+     * An effect uploaded into one of the kernel ff slots, the slot is reused
+     * as long as the same effect is played again with the same magnitude.
+     */
+    struct EffectSlot {
+        int16_t id;
+        int16_t magnitude;
+        int effectId;
+        uint32_t length;
+        const void *stream;
+        long playLengthMs;
+        uint64_t lastUsed;
+        bool pinned;
+        int64_t reservedUntilNs[RESERVE_OWNERS];
+        /* Holds a stream only valid for one play, never found by findSlot() */
+        bool uncached;
+    };
+
+    int play(int effectId, uint32_t timeoutMs, long *playLengthMs,
+             const void *stream = NULL);
+    EffectSlot *findSlot(int effectId, int16_t magnitude, uint32_t length, const void *stream);
+    EffectSlot *uploadEffect(int effectId, int16_t magnitude, uint32_t length, const void *stream,
+                             bool evictPlaying = true);
+    void releaseSlot(EffectSlot *slot);
+    int setGain(int16_t gain);
+    void applyMagnitude(int16_t magnitude);
+    void resetReservation(ReserveOwner owner);
+    bool isReserved(const EffectSlot& slot, int64_t now);
+    int probeDevice(int fd, bool cached);
+    /* Protects the playback state and the slots, playback may come from several threads */
+    std::mutex mLock;
+    /* Written under mLock, but also read without it to check the device is there */
+    std::atomic<int> mVibraFd;
     int16_t mCurrAppId;
     int16_t mCurrMagnitude;
+    int16_t mCurrGain;
+    int16_t mPendingGain;
+    int16_t mAmplitude;
+    std::vector<EffectSlot> mSlots;
+    uint64_t mSlotTick;
+    uint64_t mCacheHits;
+    uint64_t mCacheMisses;
+    uint64_t mPlayWrites;
+    uint64_t mPlayEvents;
+    int mPinnedSlots;
+    long mWarmUpTimeUs;
+    long mProbeTimeUs;
+    std::string mDevicePath;
+    /* Set when the device hung up, until rediscover() finds one */
+    std::atomic<bool> mGone;
+    int mRediscoveries;
+    ProbeCache::Entry mProbe;
+    bool mProbeFromCache;
+    bool mProbeSaved;
+    /* Set by ro.vendor.qti.vibrator.multi_slot for the drivers playing the effect of the id */
+    bool mMultiSlot;
 };
 
 class LedVibratorDevice {
 public:
     LedVibratorDevice();
+    ~LedVibratorDevice();
     int on(int32_t timeoutMs);
     int off();
+    void dump(int fd);
     bool mDetected;
 private:
-    int write_value(const char *file, const char *value);
+    int write_value(int fd, const char *value, size_t len);
+    int mActivateFd;
+    int mStateFd;
+    int mDurationFd;
+    uint64_t mWrites;
+    uint64_t mOnCount;
+    int64_t mOnTotalUs;
+    int64_t mOnMaxUs;
 };
 
+class EventLoop;
+class TimerQueue;
+
 class OffloadGlinkConnection {
 public:
+    OffloadGlinkConnection();
     int GlinkOpen(std::string& dev);
     int GlinkClose();
-    int GlinkPoll();
     int GlinkRead(uint8_t *data, size_t size);
-    int GlinkWrite(uint8_t *buf, size_t buflen);
+    int GlinkWrite(uint8_t *buf, size_t buflen, size_t *written);
 private:
     std::string dev_name;
     int fd;
@@ -85,20 +216,239 @@ private:
 
 class PatternOffload {
 public:
-    PatternOffload();
-    void SSREventListener(void);
+    PatternOffload(EventLoop& loop, TimerQueue& timers);
+    void start();
+    void SSREvent(const char *msg);
     void SendPatterns();
     int mEnabled;
 private:
+    enum OffloadState {
+        OFFLOAD_IDLE,
+        OFFLOAD_CONFIG,
+        OFFLOAD_DATA,
+    };
+
+    EventLoop& mLoop;
+    TimerQueue& mTimers;
     OffloadGlinkConnection GlinkCh;
+    OffloadState mState;
+    int mRetries;
+    uint64_t mTimerId;
+    int mChannelFd;
+    /* Data being sent, the rest is written when the channel has room again */
+    std::vector<uint8_t> mWriteBuf;
+    size_t mWritten;
     int initChannel();
+    void closeChannel();
+    void tryOffload();
+    void onChannelEvents(uint32_t events);
+    void onResponse();
     int sendData(uint8_t *data, int len);
+    int flushData();
+};
+
+/*
+ * Real-time scheduling of the timing-critical threads, configured by the
+ * ro.vendor.qti.vibrator.rt_priority, cpu_affinity and mlockall properties.
+ */
+class RealtimePolicy {
+public:
+    static void init();
+    static void apply(const char *name);
+    static void dump(int fd);
+};
+
+/*
+ * Run the background work of the HAL on a single thread: the handlers of the
+ * watched fds are called from one epoll_wait loop.
+ */
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+    int start();
+    void stop();
+    int add(int fd, uint32_t events, std::function<void(uint32_t)> handler);
+    int modify(int fd, uint32_t events);
+    void remove(int fd);
+    int addUeventHandler(std::function<void(const char *msg, int len)> handler);
+    void dump(int fd);
+private:
+    void run();
+    void handleUevents();
+    std::mutex mLock;
+    std::thread mThread;
+    std::unordered_map<int, std::shared_ptr<std::function<void(uint32_t)>>> mHandlers;
+    std::vector<std::function<void(const char*, int)>> mUeventHandlers;
+    int mEpollFd;
+    int mEventFd;
+    int mUeventFd;
+    std::atomic<bool> mExit;
+    std::atomic<int64_t> mWakeups;
+    std::atomic<int64_t> mEvents;
+    std::atomic<int64_t> mHandleTotalUs;
+    std::atomic<int64_t> mHandleMaxUs;
+};
+
+/*
+ * Run tasks at absolute CLOCK_MONOTONIC times on the event loop, from a timerfd
+ * armed for the earliest deadline of a min-heap of timers.
+ */
+class TimerQueue {
+public:
+    TimerQueue(EventLoop& loop);
+    ~TimerQueue();
+    uint64_t post(int64_t deadlineNs, std::function<void()> task);
+    bool cancel(uint64_t id);
+    void dump(int fd);
+private:
+    struct Timer {
+        int64_t deadlineNs;
+        uint64_t id;
+
+        bool operator>(const Timer& other) const {
+            return deadlineNs > other.deadlineNs ||
+                    (deadlineNs == other.deadlineNs && id > other.id);
+        }
+    };
+
+    int init();
+    void arm();
+    void expire();
+    EventLoop& mLoop;
+    std::mutex mLock;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> mHeap;
+    std::unordered_map<uint64_t, std::function<void()>> mTasks;
+    uint64_t mNextId;
+    int mTimerFd;
+    std::atomic<int64_t> mFired;
+    int64_t mCancelled;
+    std::atomic<int64_t> mLateTotalNs;
+    std::atomic<int64_t> mLateMaxNs;
+};
+
+/*
+ * Start a playback at an absolute CLOCK_MONOTONIC time, scheduling another
+ * playback replaces the pending one.
+ */
+class PlaybackScheduler {
+public:
+    PlaybackScheduler(TimerQueue& timers);
+    int schedule(int64_t startTimeNs, std::function<void()> task,
+                 std::function<void()> release = nullptr);
+    void recordStart(int64_t startTimeNs);
+    void cancel();
+    void dump(int fd);
+private:
+    TimerQueue& mTimers;
+    std::mutex mLock;
+    uint64_t mTimerId;
+    /* Releases what the pending task holds if it's replaced or cancelled */
+    std::function<void()> mRelease;
+    uint64_t mGeneration;
+    int64_t mStarts;
+    int64_t mStartErrorTotalNs;
+    int64_t mStartErrorMaxNs;
+};
+
+/*
+ * Fire an effect straight from the touchscreen events, when a touch goes down
+ * in the region armed by the framework.
+ */
+class TouchTrigger {
+public:
+    static constexpr int LATENCY_BUCKETS = 6;
+
+    TouchTrigger(EventLoop& loop);
+    ~TouchTrigger();
+    int start(std::function<void(Effect, EffectStrength)> fire);
+    void arm(int32_t left, int32_t top, int32_t right, int32_t bottom,
+             Effect effect, EffectStrength strength);
+    void disarm();
+    void dump(int fd);
+    /* Cleared from the event loop if no touchscreen is found, read by the binder threads */
+    std::atomic<bool> mEnabled;
+private:
+    struct TouchDevice {
+        int fd;
+        int32_t x;
+        int32_t y;
+        bool down;
+    };
+
+    int openDevices();
+    void handleEvents(const std::shared_ptr<TouchDevice>& devp, uint32_t pollEvents);
+    void dropDevice(const std::shared_ptr<TouchDevice>& dev);
+    bool inRegion(int32_t x, int32_t y, Effect *effect, EffectStrength *strength);
+    void recordLatency(const struct input_event& ie);
+    EventLoop& mLoop;
+    std::function<void(Effect, EffectStrength)> mFire;
+    std::vector<std::shared_ptr<TouchDevice>> mDevices;
+    /* Protects mDevices and the armed region */
+    std::mutex mLock;
+    std::atomic<bool> mArmed;
+    int32_t mLeft;
+    int32_t mTop;
+    int32_t mRight;
+    int32_t mBottom;
+    Effect mEffect;
+    EffectStrength mStrength;
+    std::atomic<int64_t> mFired;
+    std::atomic<int64_t> mLatency[LATENCY_BUCKETS];
+};
+
+/*
+ * Deliver the completion callbacks of on() and perform(). The callback is
+ * called when the driver reports the effect stopped with EV_FF_STATUS, when
+ * the effect is stopped or superseded by the HAL, or when the estimated play
+ * length elapses otherwise. A superseded effect is only completed by the
+ * caller with completeAll() once the write stopping or replacing it returned,
+ * never by track() ahead of that write.
+ */
+class CompletionTracker {
+public:
+    CompletionTracker(EventLoop& loop, TimerQueue& timers);
+    ~CompletionTracker();
+    int start(int statusFd, std::function<void()> onGone);
+    void stop();
+    void track(const std::shared_ptr<IVibratorCallback>& callback, int16_t id, long playLengthMs);
+    void completeAll();
+    void dump(int fd);
+private:
+    struct Completion {
+        std::shared_ptr<IVibratorCallback> callback;
+        int16_t id;
+        int64_t startNs;
+        int64_t expectedStopNs;
+        uint64_t timerId;
+        std::atomic<bool> done;
+    };
+
+    void handleStatus(uint32_t events);
+    void complete(int16_t id, int64_t stopNs);
+    void remove(const std::shared_ptr<Completion>& c);
+    EventLoop& mLoop;
+    TimerQueue& mTimers;
+    std::mutex mLock;
+    std::vector<std::shared_ptr<Completion>> mPending;
+    std::atomic<int> mStatusFd;
+    std::function<void()> mOnGone;
+    std::atomic<int64_t> mStatusCompletions;
+    std::atomic<int64_t> mFallbackCompletions;
+    std::atomic<int64_t> mStoppedCompletions;
+    std::atomic<int64_t> mErrorTotalUs;
+    std::atomic<int64_t> mErrorMaxUs;
 };
 
 class Vibrator : public BnVibrator {
 public:
     class InputFFDevice ff;
     class LedVibratorDevice ledVib;
+    class EventLoop loop;
+    class TimerQueue timers;
+    class PlaybackScheduler scheduler;
+    class TouchTrigger touch;
+    class CompletionTracker completion;
     Vibrator();
     ~Vibrator();
     class PatternOffload Offload;
@@ -133,14 +483,157 @@ public:
     ndk::ScopedAStatus getSupportedBraking(std::vector<Braking>* supported) override;
     ndk::ScopedAStatus composePwle(const std::vector<PrimitivePwle> &composite,
                                const std::shared_ptr<IVibratorCallback> &callback) override;
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
+    /* IVibratorExt */
+    ndk::ScopedAStatus prepare(Effect effect, EffectStrength strength);
+    ndk::ScopedAStatus trigger(const std::shared_ptr<IVibratorCallback>& callback,
+                               int32_t* _aidl_return);
+    ndk::ScopedAStatus scheduleEffect(Effect effect, EffectStrength strength, int64_t startTimeNs,
+                                      const std::shared_ptr<IVibratorCallback>& callback,
+                                      int32_t* _aidl_return);
+    ndk::ScopedAStatus scheduleCompose(const std::vector<CompositeEffect>& composite,
+                                       int64_t startTimeNs,
+                                       const std::shared_ptr<IVibratorCallback>& callback);
+    ndk::ScopedAStatus cancelScheduled();
+    ndk::ScopedAStatus armTouchRegion(int32_t left, int32_t top, int32_t right, int32_t bottom,
+                                      Effect effect, EffectStrength strength);
+    ndk::ScopedAStatus disarmTouch();
 private:
-    static void composePlayThread(Vibrator *vibrator,
-                        const std::vector<CompositeEffect>& composite,
-                        const std::shared_ptr<IVibratorCallback>& callback);
-    std::thread composeThread;
-    int epollfd;
-    int pipefd[2];
-    std::atomic<bool> inComposition;
+    /*
+     * Capabilities of the probed device, computed once and replaced as a whole
+     * when the device is probed again so the getters never have to lock.
+     */
+    struct Capabilities {
+        int32_t caps;
+        std::vector<Effect> effects;
+        std::vector<CompositePrimitive> primitives;
+        std::bitset<64> effectMask;
+        std::bitset<64> primitiveMask;
+        std::array<int32_t, 64> primitiveDurationMs;
+    };
+
+    void probeCapabilities();
+    void probePrimitiveDurations(Capabilities *c);
+    std::shared_ptr<const Capabilities> capabilities();
+    bool isEffectSupported(Effect effect, EffectStrength strength);
+    ndk::ScopedAStatus validateComposition(const std::vector<CompositeEffect>& composite,
+                                           int *totalMs);
+    void warmUp();
+    void startEffects(bool asyncWarmUp);
+    void handleDeviceUevent(const char *msg);
+    void recordComposeGap(int64_t gapUs);
+    void armComposeTimer(int64_t deadlineNs);
+    void recordComposeAdmission(int64_t elapsedUs, bool hit);
+    void recordComposeStartError(int64_t errorUs);
+    /* A validated composition, shared by all the compose() calls playing it */
+    struct ComposePlan {
+        uint64_t hash;
+        std::vector<CompositeEffect> composite;
+        std::shared_ptr<const Capabilities> caps;
+        int32_t totalMs;
+        /* What is actually played, see optimizeComposition() */
+        std::vector<CompositeEffect> steps;
+        int32_t tailDelayMs;
+#ifdef USE_EFFECT_STREAM
+        std::vector<int8_t> samples;
+        uint32_t playRateHz;
+#endif
+    };
+
+    struct PlanEntry {
+        uint64_t lastUsed;
+        std::shared_ptr<const ComposePlan> plan;
+    };
+
+    void optimizeComposition(const Capabilities& c, const std::vector<CompositeEffect>& composite,
+                             std::vector<CompositeEffect>& steps, int32_t *tailDelayMs);
+    ndk::ScopedAStatus getComposePlan(const std::vector<CompositeEffect>& composite,
+                                      std::shared_ptr<const ComposePlan> *plan, bool *hit);
+#ifdef USE_EFFECT_STREAM
+    bool playComposedStream(const ComposePlan& plan, long *playLengthMs);
+#endif
+    struct ComposeCommand {
+        std::shared_ptr<const ComposePlan> plan;
+        std::shared_ptr<IVibratorCallback> callback;
+        uint64_t stopSeq;
+        /* Time the composition is scheduled at, 0 if it's not scheduled */
+        int64_t scheduledNs;
+    };
+
+    ndk::ScopedAStatus performAt(Effect effect, EffectStrength strength,
+                                 const std::shared_ptr<IVibratorCallback>& callback,
+                                 int32_t* _aidl_return, int64_t scheduledNs);
+    ndk::ScopedAStatus composeAt(const std::vector<CompositeEffect>& composite,
+                                 const std::shared_ptr<IVibratorCallback>& callback,
+                                 int64_t scheduledNs);
+
+    void composeStart();
+    void composeStep();
+    void composeFinish(bool stopped);
+    void composeNext();
+    void composeEvent();
+    void composeTimer();
+    std::mutex composeLock;
+    /*
+     * Composition handed to the event loop by an atomic exchange, a new one
+     * replaces it if the loop didn't take it yet
+     */
+    std::atomic<ComposeCommand*> composeNextCmd;
+    /* Set up on the event loop when a device supporting effects shows up late */
+    std::atomic<int> composeEventFd;
+    int composeTimerFd;
+    std::atomic<uint64_t> composeStopSeq;
+    std::atomic<int> composePending;
+    bool effectsStarted;
+    /* Warms up a device found again, away from the event loop thread */
+    std::thread warmUpThread;
+    /* State of the composition being played, only used on the event loop thread */
+    ComposeCommand composeCmd;
+    bool composeRunning;
+    bool composeStreaming;
+    bool composeDelayDone;
+    size_t composeIndex;
+    int64_t composeDeadlineNs;
+    long composePlayLengthMs;
+    std::atomic<int64_t> composeGapCount;
+    std::atomic<int64_t> composeGapTotalUs;
+    std::atomic<int64_t> composeGapMaxUs;
+    std::atomic<int64_t> composeAdmitCount;
+    std::atomic<int64_t> composeAdmitTotalUs;
+    std::atomic<int64_t> composeAdmitMaxUs;
+    std::mutex planLock;
+    std::vector<PlanEntry> planCache;
+    uint64_t planTick;
+    std::atomic<int64_t> planHits;
+    std::atomic<int64_t> planMisses;
+    std::atomic<int64_t> planHitAdmitTotalUs;
+    std::atomic<int64_t> planMissAdmitTotalUs;
+    std::atomic<int64_t> planElements;
+    std::atomic<int64_t> planSteps;
+    float composeMinScale;
+    std::atomic<int64_t> composeStartCount;
+    std::atomic<int64_t> composeStartErrorTotalUs;
+    std::atomic<int64_t> composeStartErrorMaxUs;
+    std::atomic<int64_t> composeDriftLastUs;
+    std::atomic<int64_t> composeDriftMaxUs;
+    std::atomic<int64_t> preemptStartUs;
+    std::atomic<int64_t> preemptCount;
+    std::atomic<int64_t> preemptTotalUs;
+    std::atomic<int64_t> preemptMaxUs;
+    Effect preparedEffect;
+    EffectStrength preparedStrength;
+    std::atomic<int64_t> preparedExpireNs;
+    int64_t prepareTtlNs;
+    std::atomic<int64_t> prepareCount;
+    std::atomic<int64_t> triggerCount;
+    std::atomic<int64_t> triggerExpiredCount;
+    std::shared_ptr<const Capabilities> caps;
+    /*
+     * Serializes the playback calls and the composition steps on the event loop,
+     * so the completion tracks the effect they played
+     */
+    std::mutex playLock;
 };
 
 }  // namespace vibrator
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause-Clear
+ */
+
+#pragma once
+
+#include <aidl/vendor/qti/hardware/vibrator/ext/BnVibratorExt.h>
+
+#include "Vibrator.h"
+
+namespace aidl {
+namespace vendor {
+namespace qti {
+namespace hardware {
+namespace vibrator {
+namespace ext {
+
+using ::aidl::android::hardware::vibrator::CompositeEffect;
+using ::aidl::android::hardware::vibrator::Effect;
+using ::aidl::android::hardware::vibrator::EffectStrength;
+using ::aidl::android::hardware::vibrator::IVibratorCallback;
+using ::aidl::android::hardware::vibrator::Vibrator;
+
+class VibratorExt : public BnVibratorExt {
+public:
+    VibratorExt(const std::shared_ptr<Vibrator>& vibrator);
+
+    ndk::ScopedAStatus prepare(Effect effect, EffectStrength strength) override;
+    ndk::ScopedAStatus trigger(const std::shared_ptr<IVibratorCallback>& callback,
+                               int32_t* _aidl_return) override;
+    ndk::ScopedAStatus scheduleEffect(Effect effect, EffectStrength strength,
+                                      int64_t startTimeNs,
+                                      const std::shared_ptr<IVibratorCallback>& callback,
+                                      int32_t* _aidl_return) override;
+    ndk::ScopedAStatus scheduleCompose(const std::vector<CompositeEffect>& composite,
+                                       int64_t startTimeNs,
+                                       const std::shared_ptr<IVibratorCallback>& callback) override;
+    ndk::ScopedAStatus cancelScheduled() override;
+    ndk::ScopedAStatus armTouchRegion(int32_t left, int32_t top, int32_t right, int32_t bottom,
+                                      Effect effect, EffectStrength strength) override;
+    ndk::ScopedAStatus disarmTouch() override;
+private:
+    std::shared_ptr<Vibrator> mVibrator;
+};
+
+}  // namespace ext
+}  // namespace vibrator
+}  // namespace hardware
+}  // namespace qti
+}  // namespace vendor
+}  // namespace aidl
@@ -32,18 +32,54 @@
 #include <android-base/logging.h>
 #include <android/binder_manager.h>
 #include <android/binder_process.h>
+#include <cutils/properties.h>
+#include <time.h>
 
 #include "Vibrator.h"
+#include "VibratorExt.h"
 
 using aidl::android::hardware::vibrator::Vibrator;
+using aidl::vendor::qti::hardware::vibrator::ext::VibratorExt;
+
+static int64_t getMonotonicUs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 int main() {
-    ABinderProcess_setThreadPoolMaxThreadCount(0);
+    int64_t startUs = getMonotonicUs();
+    /*
+     * Extra binder threads let the getters be served while a playback call is
+     * in flight, the playback calls are still serialized by the HAL.
+     */
+    int32_t threads = property_get_int32("ro.vendor.qti.vibrator.binder_threads", 0);
+
+    ABinderProcess_setThreadPoolMaxThreadCount(threads > 0 ? threads : 0);
+    if (threads > 0)
+        ABinderProcess_startThreadPool();
     std::shared_ptr<Vibrator> vib = ndk::SharedRefBase::make<Vibrator>();
+    std::shared_ptr<VibratorExt> ext = ndk::SharedRefBase::make<VibratorExt>(vib);
+
+    binder_status_t status = AIBinder_setExtension(vib->asBinder().get(), ext->asBinder().get());
+    CHECK(status == STATUS_OK);
 
     const std::string instance = std::string() + Vibrator::descriptor + "/default";
-    binder_status_t status = AServiceManager_addService(vib->asBinder().get(), instance.c_str());
+    status = AServiceManager_addService(vib->asBinder().get(), instance.c_str());
     CHECK(status == STATUS_OK);
+    LOG(INFO) << instance << " is added " << getMonotonicUs() - startUs << "us after start";
+
+    /*
+     * The device needs a service_contexts label for the instance, the sepolicy
+     * allowing the HAL to add it and a framework compatibility matrix entry.
+     * Without them the ext is still reachable with AIBinder_getExtension(), so
+     * the failure mustn't take IVibrator down.
+     */
+    const std::string extInstance = std::string() + VibratorExt::descriptor + "/default";
+    status = AServiceManager_addService(ext->asBinder().get(), extInstance.c_str());
+    if (status != STATUS_OK)
+        LOG(WARNING) << "Failed to add " << extInstance << ", status " << status;
 
     ABinderProcess_joinThreadPool();
     return EXIT_FAILURE;  // should not reach